@@ -1,4 +1,6 @@
 #include "backupheader.h"
+#include "probes.h"
+#include <array>
 #include <sodium/crypto_pwhash.h>
 #include <sodium/crypto_secretstream_xchacha20poly1305.h>
 #include <vector>
@@ -12,12 +14,30 @@ class ByteDescr : public HeaderFieldDescription {
 private:
   uint64_t _size;
   string _name;
+  Bytes BackupHeaderEntries::*_field;
 
 public:
-  ByteDescr(uint64_t size, string name) : _size(size), _name(name) {}
+  /// Without `field` the bytes are skipped when decoding and zero
+  ByteDescr(uint64_t size, string name,
+            Bytes BackupHeaderEntries::*field = nullptr)
+      : _size(size), _name(name), _field(field) {}
   uint64_t size() const override { return _size; }
-  std::any decode(Bytes &&data) const override {
-    return make_any<Bytes>(std::move(data));
+  void decode(ArrayView<char> data,
+              BackupHeaderEntries &entries) const override {
+    if (_field) {
+      entries.*_field = Bytes(data);
+    }
+  }
+  void encode(const BackupHeaderEntries &entries, char *out) const override {
+    if (!_field) {
+      memset(out, 0, _size);
+      return;
+    }
+    auto &data = entries.*_field;
+    if (static_cast<uint64_t>(data.size()) != _size) {
+      fail("Invalid size of bytes-field\n");
+    }
+    memcpy(out, data.ptr_const(), _size);
   }
 
   std::string name() const { return _name; }
@@ -28,12 +48,23 @@ class StringDescr : public HeaderFieldDescription {
 private:
   uint64_t _size;
   string _name;
+  string BackupHeaderEntries::*_field;
 
 public:
-  StringDescr(uint64_t size, string name) : _size(size), _name(name) {}
+  StringDescr(uint64_t size, string name, string BackupHeaderEntries::*field)
+      : _size(size), _name(name), _field(field) {}
   uint64_t size() const override { return _size; }
-  std::any decode(Bytes &&data) const override {
-    return make_any<string>(data.as_str());
+  void decode(ArrayView<char> data,
+              BackupHeaderEntries &entries) const override {
+    entries.*_field = data.as_str();
+  }
+  void encode(const BackupHeaderEntries &entries, char *out) const override {
+    auto &str = entries.*_field;
+    if (str.length() > _size) {
+      fail("String too long for string-field\n");
+    }
+    memset(out, 0, _size);
+    memcpy(out, str.data(), str.length());
   }
   std::string name() const { return _name; }
 };
@@ -42,30 +73,46 @@ public:
 template <typename T> class TypeBEDescr : public HeaderFieldDescription {
 private:
   string _name;
+  T BackupHeaderEntries::*_field;
 
 public:
-  TypeBEDescr(string name) : _name(name) {}
+  TypeBEDescr(string name, T BackupHeaderEntries::*field)
+      : _name(name), _field(field) {}
   uint64_t size() const override { return sizeof(T); }
-  std::any decode(Bytes &&data) const override {
-    return make_any<T>(data.as_type_be<T>());
+  void decode(ArrayView<char> data,
+              BackupHeaderEntries &entries) const override {
+    entries.*_field = data.as_type_be<T>();
+  }
+  void encode(const BackupHeaderEntries &entries, char *out) const override {
+    auto el = entries.*_field;
+#ifndef IS_BIG_ENDIAN
+    el = swap_endian(el);
+#endif
+    memcpy(out, &el, sizeof(T));
   }
   std::string name() const { return _name; }
 };
 
 /// The descriptions of the current fields of the header
 static std::array<HeaderFieldDescription *, 5> HeaderList = {
-    new StringDescr(4, "platform"), new ByteDescr(1, "empty"),
-    new TypeBEDescr<uint16_t>("version"), new ByteDescr(16, "salt"),
-    new ByteDescr(32, "uuid")};
+    new StringDescr(4, "platform", &BackupHeaderEntries::platform),
+    new ByteDescr(1, "empty"),
+    new TypeBEDescr<uint16_t>("version", &BackupHeaderEntries::version),
+    new ByteDescr(16, "salt", &BackupHeaderEntries::salt),
+    new ByteDescr(32, "uuid", &BackupHeaderEntries::uuidhash)};
 
 Bytes BackupHeader::hash(const UUID &uuid, const Bytes &salt) const {
   const int hashSize = 32;
   auto hash = DynamicArray<char>(hashSize);
-  if (crypto_pwhash_argon2i(hash.ptr_unsigned(), hashSize, uuid.c_str(),
-                            uuid.length(), salt.ptr_unsigned_const(),
-                            crypto_pwhash_argon2i_OPSLIMIT_INTERACTIVE,
-                            crypto_pwhash_argon2i_MEMLIMIT_INTERACTIVE,
-                            crypto_pwhash_argon2i_ALG_ARGON2I13) != 0) {
+  PROBE2(argon2__start, crypto_pwhash_argon2i_OPSLIMIT_INTERACTIVE,
+         crypto_pwhash_argon2i_MEMLIMIT_INTERACTIVE);
+  auto res = crypto_pwhash_argon2i(hash.ptr_unsigned(), hashSize, uuid.c_str(),
+                                   uuid.length(), salt.ptr_unsigned_const(),
+                                   crypto_pwhash_argon2i_OPSLIMIT_INTERACTIVE,
+                                   crypto_pwhash_argon2i_MEMLIMIT_INTERACTIVE,
+                                   crypto_pwhash_argon2i_ALG_ARGON2I13);
+  PROBE1(argon2__done, res);
+  if (res != 0) {
     fail("Cannot computer hash\n");
   }
   return hash;
@@ -79,17 +126,7 @@ BackupHeader::BackupHeader(Bytes &&buffer) {
   int idx = 0;
   for (auto el : HeaderList) {
     auto len = el->size();
-    auto res = el->decode(buffer.copy_sub(idx, idx + len));
-    auto name = el->name();
-    if (name == "platform") {
-      _entries.platform = any_cast<string>(res);
-    } else if (name == "version") {
-      _entries.version = any_cast<uint16_t>(res);
-    } else if (name == "salt") {
-      _entries.salt = any_cast<Bytes>(res);
-    } else if (name == "uuid") {
-      _entries.uuidhash = any_cast<Bytes>(res);
-    }
+    el->decode(buffer.sub(idx, idx + len), _entries);
     idx += len;
   }
 
@@ -97,6 +134,23 @@ BackupHeader::BackupHeader(Bytes &&buffer) {
         _entries.version);
 }
 
+BackupHeader::BackupHeader(const UUID &uuid, Bytes &&salt) {
+  _entries.platform = "WBUI";
+  _entries.version = 1;
+  _entries.uuidhash = hash(uuid, salt);
+  _entries.salt = std::move(salt);
+}
+
+Bytes BackupHeader::serialize() const {
+  auto res = Bytes(size_of_all_field());
+  int idx = 0;
+  for (auto el : HeaderList) {
+    el->encode(_entries, res.ptr() + idx);
+    idx += el->size();
+  }
+  return res;
+}
+
 Key BackupHeader::deriveKey(const Password &password) const {
 #if 0
     if (hash(password.uuid, _entries.salt) != _entries.uuidhash){
@@ -108,7 +162,7 @@ Key BackupHeader::deriveKey(const Password &password) const {
   return Key(password.password, _entries.salt.clone());
 }
 
-BackupHeaderEntries BackupHeader::entries() const { return _entries; }
+const BackupHeaderEntries &BackupHeader::entries() const { return _entries; }
 
 uint64_t BackupHeader::size_of_all_field() {
   uint64_t res = 0;
@@ -122,14 +176,18 @@ Key::Key() {}
 
 template <typename T, int N> constexpr int as(T (&)[N]) { return N; }
 
-Key::Key(string password, Bytes &&_salt) : salt(std::move(_salt)) {
+Key::Key(const string &password, Bytes &&_salt) : salt(std::move(_salt)) {
   auto buffer = Bytes(crypto_secretstream_xchacha20poly1305_KEYBYTES);
-  if (crypto_pwhash_argon2i(buffer.ptr_unsigned(), buffer.size(),
-                            password.c_str(), password.length(),
-                            salt.ptr_unsigned(),
-                            crypto_pwhash_argon2i_OPSLIMIT_MODERATE,
-                            crypto_pwhash_argon2i_MEMLIMIT_MODERATE,
-                            crypto_pwhash_argon2i_ALG_ARGON2I13) != 0) {
+  PROBE2(argon2__start, crypto_pwhash_argon2i_OPSLIMIT_MODERATE,
+         crypto_pwhash_argon2i_MEMLIMIT_MODERATE);
+  auto res = crypto_pwhash_argon2i(buffer.ptr_unsigned(), buffer.size(),
+                                   password.c_str(), password.length(),
+                                   salt.ptr_unsigned(),
+                                   crypto_pwhash_argon2i_OPSLIMIT_MODERATE,
+                                   crypto_pwhash_argon2i_MEMLIMIT_MODERATE,
+                                   crypto_pwhash_argon2i_ALG_ARGON2I13);
+  PROBE1(argon2__done, res);
+  if (res != 0) {
     fail("Cannot derive key\n");
   }
 #if 0
@@ -1,7 +1,6 @@
 #ifndef BACKUPHEADER_H
 #define BACKUPHEADER_H
 #include "utils.h"
-#include <any>
 #include <string>
 
 using namespace std;
@@ -25,22 +24,11 @@ struct Password {
  */
 struct Key {
   Key();
-  Key(string password, Bytes &&salt);
+  Key(const string &password, Bytes &&salt);
   Bytes password;
   Bytes salt;
 };
 
-/**
- * Describes an entry of the backup header
- */
-class HeaderFieldDescription {
-public:
-  virtual uint64_t size() const = 0;
-  virtual ~HeaderFieldDescription() {}
-  virtual std::any decode(Bytes &&data) const = 0;
-  virtual string name() const = 0;
-};
-
 /**
  * Holds information needed for decrypting
  */
@@ -50,11 +38,25 @@ struct BackupHeaderEntries {
   uint16_t version;
   Bytes salt;
   Bytes uuidhash;
-  inline BackupHeaderEntries(const BackupHeaderEntries &other)
-      : platform(other.platform), emptySpace(other.emptySpace),
-        version(other.version), salt(other.salt.clone()),
-        uuidhash(other.uuidhash.clone()) {}
-  BackupHeaderEntries() = default;
+};
+
+/**
+ * Describes an entry of the backup header
+ */
+class HeaderFieldDescription {
+public:
+  virtual uint64_t size() const = 0;
+  virtual ~HeaderFieldDescription() {}
+  /**
+   * Reads the field from `data` (`size()` bytes) into `entries`
+   */
+  virtual void decode(ArrayView<char> data,
+                      BackupHeaderEntries &entries) const = 0;
+  /**
+   * Writes the field from `entries` to `out` (`size()` bytes)
+   */
+  virtual void encode(const BackupHeaderEntries &entries, char *out) const = 0;
+  virtual string name() const = 0;
 };
 
 /**
@@ -71,6 +73,12 @@ public:
    * Parse the header using the given `buffer`
    */
   BackupHeader(Bytes &&buffer);
+  /**
+   * Create a new header for the user with the given `uuid`
+   * @param uuid The uuid of the user the backup is made for
+   * @param salt The salt for deriving the key (16 bytes)
+   */
+  BackupHeader(const UUID &uuid, Bytes &&salt);
   /**
    * Derive the key which can decrypt the data using the
    * given `password`
@@ -82,7 +90,13 @@ public:
   /**
    * Returns the values of the header entries
    */
-  BackupHeaderEntries entries() const;
+  const BackupHeaderEntries &entries() const;
+
+  /**
+   * Returns the header in its binary form.
+   * This is the inverse of the parsing constructor.
+   */
+  Bytes serialize() const;
 
   /**
    * Returns the size of all header entries.
@@ -1,16 +1,26 @@
 #include "crypto.h"
+#include "probes.h"
+#include <functional>
+#include <future>
 #include <iostream>
 
+#include <sodium/crypto_pwhash.h>
 #include <sodium/crypto_secretstream_xchacha20poly1305.h>
-
-const uint64_t BUFFER_SIZE = 1024 * 1024;
+#include <sodium/randombytes.h>
 
 #define fail(descr)                                                            \
   debug(descr);                                                                \
   throw CryptoException(descr);
 
-int decrypt(std::istream &input, std::ostream &output, Password password) {
-  // Read the header
+/// Called for every decrypted chunk with its data, length and tag
+using ChunkHandler =
+    std::function<void(const char *, unsigned long long, unsigned char)>;
+/// Provides the buffer the next chunk is decrypted into, may return nullptr
+using BufferProvider = std::function<char *(size_t)>;
+
+/// Reads and parses the Wire-specific header
+static BackupHeader read_header(std::istream &input) {
+  PROBE0(header__start);
   auto buffer = DynamicArray<char>(BackupHeader::size_of_all_field());
   input.read(buffer.ptr(), buffer.size());
   if (static_cast<uint64_t>(input.gcount()) !=
@@ -19,12 +29,17 @@ int decrypt(std::istream &input, std::ostream &output, Password password) {
   }
 
   BackupHeader header(std::move(buffer));
+  PROBE1(header__done, header.entries().version);
   if (header.entries().platform != "WBUI" || header.entries().version != 1) {
     std::cerr << "Unsupported file, expect errors" << std::endl;
   }
-  // derive key
-  auto key = header.deriveKey(password);
+  return header;
+}
 
+/// Decrypts everything after the header and hands the chunks to `handle`
+static uint64_t decrypt_body(std::istream &input, const Key &key,
+                             const ChunkHandler &handle,
+                             const BufferProvider &provide = nullptr) {
   // init crypto header
   crypto_secretstream_xchacha20poly1305_state state;
   memset(&state, 0, sizeof(state));
@@ -63,27 +78,38 @@ int decrypt(std::istream &input, std::ostream &output, Password password) {
   auto cipherBuffer = DynamicArray<char>(cipherBufferSize);
   unsigned char tag = 0;
 
-  auto totalBytesWritten = 0;
-  auto bytesWritten = -1;
-  auto bytesRead = -1;
+  uint64_t totalBytesWritten = 0;
+  uint64_t chunkIndex = 0;
+  int64_t bytesWritten = -1;
+  int64_t bytesRead = -1;
 
   while (true) {
     input.read(cipherBuffer.ptr(), cipherBuffer.size());
     bytesRead = input.gcount();
-    if (bytesRead == 0)
-      continue;
+    // The data ended before the final chunk
+    if (bytesRead == 0) {
+      fail("Unexpected end of encrypted data\n");
+    }
 
+    char *message = provide ? provide(msgBuffer.size()) : nullptr;
+    if (!message)
+      message = msgBuffer.ptr();
     unsigned long long messageLength = msgBuffer.size();
     unsigned long long cipherLength = bytesRead;
+    PROBE2(chunk__pull__start, chunkIndex, cipherLength);
     if (crypto_secretstream_xchacha20poly1305_pull(
-            &state, msgBuffer.ptr_unsigned(), &messageLength, &tag,
+            &state, reinterpret_cast<unsigned char *>(message),
+            &messageLength, &tag,
             cipherBuffer.ptr_unsigned(), cipherLength, nullptr, 0) != 0) {
       fail("Cannot decrypt xchacha20poly1305\n");
     }
+    PROBE3(chunk__pull__done, chunkIndex, messageLength, tag);
 
-    auto beg = output.tellp();
-    output.write(msgBuffer.ptr(), messageLength);
-    bytesWritten = output.tellp() - beg;
+    PROBE2(chunk__write__start, chunkIndex, messageLength);
+    handle(message, messageLength, tag);
+    PROBE2(chunk__write__done, chunkIndex, messageLength);
+    chunkIndex++;
+    bytesWritten = messageLength;
     totalBytesWritten += bytesWritten;
 
     if (tag == crypto_secretstream_xchacha20poly1305_TAG_FINAL) {
@@ -105,3 +131,96 @@ int decrypt(std::istream &input, std::ostream &output, Password password) {
 
   return totalBytesWritten;
 }
+
+int decrypt(std::istream &input, std::ostream &output, Password password) {
+  StreamSink sink(output);
+  return decrypt(input, sink, password);
+}
+
+uint64_t decrypt(std::istream &input, ChunkSink &output, Password password) {
+  auto header = read_header(input);
+  // derive key
+  auto key = header.deriveKey(password);
+
+  auto res = decrypt_body(
+      input, key,
+      [&](const char *data, unsigned long long length, unsigned char) {
+        output.consume(data, length);
+      },
+      [&](size_t length) { return output.buffer(length); });
+  output.finish();
+  return res;
+}
+
+uint64_t rekey(std::istream &input, std::ostream &output,
+               Password oldPassword, Password newPassword) {
+  auto header = read_header(input);
+
+  // The key derivations are independent and each one takes a while,
+  // so they run at the same time.
+  auto salt = Bytes(crypto_pwhash_argon2i_SALTBYTES);
+  randombytes_buf(salt.ptr(), salt.size());
+  auto newKey = std::async(std::launch::async, [&] {
+    return Key(newPassword.password, salt.clone());
+  });
+  auto newHeader = std::async(std::launch::async, [&] {
+    return BackupHeader(newPassword.uuid, salt.clone());
+  });
+  auto oldKey = header.deriveKey(oldPassword);
+  auto key = newKey.get();
+  auto headerBuffer = newHeader.get().serialize();
+
+  output.write(headerBuffer.ptr(), headerBuffer.size());
+
+  crypto_secretstream_xchacha20poly1305_state state;
+  unsigned char chachaheader[crypto_secretstream_xchacha20poly1305_HEADERBYTES];
+  if (crypto_secretstream_xchacha20poly1305_init_push(
+          &state, chachaheader, key.password.ptr_unsigned_const()) != 0) {
+    fail("Cannot init xchacha20poly1305\n");
+  }
+  // Same as for decrypting, see there
+  state.nonce[0] = 0;
+  output.write((char *)chachaheader,
+               crypto_secretstream_xchacha20poly1305_HEADERBYTES);
+
+  // Every chunk is encrypted again right away, so the chunk
+  // layout stays the same and no plaintext leaves the memory
+  auto cipherBuffer = DynamicArray<char>(
+      BUFFER_SIZE + crypto_secretstream_xchacha20poly1305_ABYTES);
+  auto res = decrypt_body(
+      input, oldKey,
+      [&](const char *data, unsigned long long length, unsigned char tag) {
+        unsigned long long cipherLength = 0;
+        if (crypto_secretstream_xchacha20poly1305_push(
+                &state, cipherBuffer.ptr_unsigned(), &cipherLength,
+                reinterpret_cast<const unsigned char *>(data), length,
+                nullptr, 0, tag) != 0) {
+          fail("Cannot encrypt xchacha20poly1305\n");
+        }
+        if (!output.write(cipherBuffer.ptr(), cipherLength)) {
+          fail("Cannot write output\n");
+        }
+      });
+
+  if (!output.flush()) {
+    fail("Cannot write output\n");
+  }
+  return res;
+}
+
+uint64_t plaintext_size(uint64_t cipherLength) {
+  const uint64_t prefix = BackupHeader::size_of_all_field() +
+                          crypto_secretstream_xchacha20poly1305_HEADERBYTES;
+  if (cipherLength <= prefix) {
+    return 0;
+  }
+  const uint64_t chunkSize =
+      BUFFER_SIZE + crypto_secretstream_xchacha20poly1305_ABYTES;
+  auto body = cipherLength - prefix;
+  auto chunks = (body + chunkSize - 1) / chunkSize;
+  auto overhead = chunks * crypto_secretstream_xchacha20poly1305_ABYTES;
+  if (body < overhead) {
+    return 0;
+  }
+  return body - overhead;
+}
@@ -2,9 +2,13 @@
 #define CRYPTO_H
 
 #include "backupheader.h"
+#include "sink.h"
 #include <exception>
 #include <istream>
 
+/// Size of the decrypted chunks, the last one may be shorter
+const uint64_t BUFFER_SIZE = 1024 * 1024;
+
 /**
  * Decrypts the data from input to output using the given password.
  * @param input A stream which gives the encrypted data
@@ -14,6 +18,38 @@
  */
 int decrypt(std::istream &input, std::ostream &output, Password password);
 
+/**
+ * Decrypts the data from input using the given password and hands each
+ * decrypted chunk to `output`. Use `FanOutSink` to feed several consumers
+ * without reading the data twice.
+ * @param input A stream which gives the encrypted data
+ * @param output The sink which receives the decrypted data
+ * @param password The password for decrypting
+ * @return The lenght of the decrypted data
+ */
+uint64_t decrypt(std::istream &input, ChunkSink &output, Password password);
+
+/**
+ * Re-encrypts the data from input with a new password in one pass.
+ * The decrypted data is only held in memory chunk by chunk.
+ * @param input A stream which gives the encrypted data
+ * @param output A stream where the newly encrypted data should be written at
+ * @param oldPassword The password the data is currently encrypted with
+ * @param newPassword The password (and uuid of the user) for the new backup
+ * @return The lenght of the decrypted data
+ */
+uint64_t rekey(std::istream &input, std::ostream &output,
+               Password oldPassword, Password newPassword);
+
+/**
+ * Computes the size of the decrypted data from the size of the encrypted
+ * data. The backup is split into chunks of a fixed size, each carrying
+ * its own authentication tag, so the result is exact.
+ * @param cipherLength The size of the whole encrypted backup (incl. header)
+ * @return The number of bytes `decrypt` will write
+ */
+uint64_t plaintext_size(uint64_t cipherLength);
+
 class CryptoException : public std::exception {
 private:
   std::string _text;
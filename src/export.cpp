@@ -0,0 +1,354 @@
+#include "export.h"
+#include <cerrno>
+#include <fstream>
+#include <memory>
+#include <sqlite3.h>
+#include <sys/stat.h>
+#include <thread>
+
+/// Number of rows which are written at once
+const uint32_t BATCH_ROWS = 64 * 1024;
+/// File extensions of SQLite databases in the backup
+const std::vector<std::string> DATABASE_EXTENSIONS = {".wiredatabase",
+                                                      ".sqlite", ".db"};
+/// Largest database which is extracted into memory
+const uint64_t MAX_DATABASE_SIZE = 2ULL * 1024 * 1024 * 1024;
+/// Memory reserved up front at most, the rest grows with the data
+const uint64_t MAX_DATABASE_RESERVE = 64 * 1024 * 1024;
+const uint16_t METHOD_STORED = 0;
+const uint16_t METHOD_DEFLATED = 8;
+
+#define fail(descr)                                                            \
+  debug(descr);                                                                \
+  throw ExportException(descr);
+
+/// Whether `name` can be used as a single path component
+static bool is_safe_name(const std::string &name) {
+  return !name.empty() && name != "." && name != ".." &&
+         name.find('/') == std::string::npos;
+}
+
+static void make_dir(const std::string &path) {
+  if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+    fail("Cannot create export directory\n");
+  }
+}
+
+/// Collects the values of one column and writes them batch by batch
+class ColumnWriter {
+public:
+  enum class Type { Int64, Double, Binary };
+
+  ColumnWriter(const std::string &path, Type type)
+      : _type(type), _file(path, std::ios::binary | std::ios::trunc),
+        _rows(0) {
+    if (!_file) {
+      fail("Cannot create column file\n");
+    }
+    reset();
+  }
+
+  /// Derives the type from the declared type of the column
+  static Type type_of(const char *declared) {
+    std::string decl = declared ? declared : "";
+    for (auto &c : decl)
+      c = toupper(c);
+    if (decl.find("INT") != std::string::npos) {
+      return Type::Int64;
+    }
+    for (auto name : {"REAL", "FLOA", "DOUB", "TIMESTAMP", "DATE"}) {
+      if (decl.find(name) != std::string::npos) {
+        return Type::Double;
+      }
+    }
+    return Type::Binary;
+  }
+
+  static const char *type_name(Type type) {
+    switch (type) {
+    case Type::Int64:
+      return "int64";
+    case Type::Double:
+      return "double";
+    default:
+      return "binary";
+    }
+  }
+
+  void add(sqlite3_stmt *stmt, int idx) {
+    bool valid = sqlite3_column_type(stmt, idx) != SQLITE_NULL;
+    if (_rows % 8 == 0) {
+      _validity.push_back(0);
+    }
+    if (valid) {
+      _validity.back() |= 1 << (_rows % 8);
+    }
+    switch (_type) {
+    case Type::Int64:
+      _ints.push_back(valid ? sqlite3_column_int64(stmt, idx) : 0);
+      break;
+    case Type::Double:
+      _doubles.push_back(valid ? sqlite3_column_double(stmt, idx) : 0);
+      break;
+    case Type::Binary:
+      if (valid) {
+        auto blob = static_cast<const char *>(sqlite3_column_blob(stmt, idx));
+        auto len = sqlite3_column_bytes(stmt, idx);
+        _data.insert(_data.end(), blob, blob + len);
+      }
+      _offsets.push_back(_data.size());
+      break;
+    }
+    _rows++;
+  }
+
+  void flush() {
+    if (_rows == 0)
+      return;
+    write(&_rows, sizeof(_rows));
+    write(_validity.data(), _validity.size());
+    switch (_type) {
+    case Type::Int64:
+      write(_ints.data(), _ints.size() * sizeof(int64_t));
+      break;
+    case Type::Double:
+      write(_doubles.data(), _doubles.size() * sizeof(double));
+      break;
+    case Type::Binary:
+      write(_offsets.data(), _offsets.size() * sizeof(uint64_t));
+      write(_data.data(), _data.size());
+      break;
+    }
+    reset();
+  }
+
+private:
+  void write(const void *data, size_t length) {
+    if (!_file.write(static_cast<const char *>(data), length)) {
+      fail("Cannot write column file\n");
+    }
+  }
+
+  void reset() {
+    _rows = 0;
+    _validity.clear();
+    _ints.clear();
+    _doubles.clear();
+    _offsets.assign(1, 0);
+    _data.clear();
+  }
+
+  Type _type;
+  std::ofstream _file;
+  uint32_t _rows;
+  std::vector<uint8_t> _validity;
+  std::vector<int64_t> _ints;
+  std::vector<double> _doubles;
+  std::vector<uint64_t> _offsets;
+  std::vector<char> _data;
+};
+
+static void export_table(unsigned char *database, size_t size,
+                         const std::string &outputDir,
+                         const std::string &table) {
+  sqlite3 *handle = nullptr;
+  auto res = sqlite3_open(":memory:", &handle);
+  std::unique_ptr<sqlite3, decltype(&sqlite3_close)> db(handle, sqlite3_close);
+  if (res != SQLITE_OK) {
+    fail("Cannot open database\n");
+  }
+  // Every thread has its own connection to the same read-only memory
+  if (sqlite3_deserialize(db.get(), "main", database, size, size,
+                          SQLITE_DESERIALIZE_READONLY) != SQLITE_OK) {
+    fail("Cannot load database\n");
+  }
+
+  sqlite3_stmt *handleStmt = nullptr;
+  auto query = "SELECT * FROM \"" + table + "\"";
+  res = sqlite3_prepare_v2(db.get(), query.c_str(), -1, &handleStmt, nullptr);
+  std::unique_ptr<sqlite3_stmt, decltype(&sqlite3_finalize)> stmt(
+      handleStmt, sqlite3_finalize);
+  if (res != SQLITE_OK) {
+    debug("Table %s not found\n", table.c_str());
+    return;
+  }
+
+  auto dir = outputDir + "/" + table;
+  make_dir(dir);
+  std::ofstream schema(dir + "/schema", std::ios::trunc);
+  std::vector<std::unique_ptr<ColumnWriter>> columns;
+  for (int i = 0; i < sqlite3_column_count(stmt.get()); i++) {
+    std::string name = sqlite3_column_name(stmt.get(), i);
+    auto type =
+        ColumnWriter::type_of(sqlite3_column_decltype(stmt.get(), i));
+    schema << name << " " << ColumnWriter::type_name(type) << "\n";
+    // Column names come from the backup, so they are not used as paths
+    columns.emplace_back(
+        new ColumnWriter(dir + "/" + std::to_string(i) + ".col", type));
+  }
+  if (!schema.flush()) {
+    fail("Cannot write schema\n");
+  }
+
+  uint64_t rows = 0;
+  while ((res = sqlite3_step(stmt.get())) == SQLITE_ROW) {
+    for (size_t i = 0; i < columns.size(); i++) {
+      columns[i]->add(stmt.get(), i);
+    }
+    if (++rows % BATCH_ROWS == 0) {
+      for (auto &column : columns) {
+        column->flush();
+      }
+    }
+  }
+  if (res != SQLITE_DONE) {
+    fail("Cannot read table\n");
+  }
+  for (auto &column : columns) {
+    column->flush();
+  }
+}
+
+void export_tables(unsigned char *database, size_t size,
+                   const std::string &outputDir,
+                   const std::vector<std::string> &tables) {
+  for (auto &table : tables) {
+    if (!is_safe_name(table)) {
+      fail("Invalid table name\n");
+    }
+  }
+  make_dir(outputDir);
+  // Databases in WAL mode cannot be opened from memory. The backup has no
+  // WAL file anyway, so switch the header to the rollback journal.
+  if (size > 19 && database[18] == 2 && database[19] == 2) {
+    database[18] = database[19] = 1;
+  }
+  std::vector<std::thread> workers;
+  std::vector<std::exception_ptr> errors(tables.size());
+  for (size_t i = 0; i < tables.size(); i++) {
+    workers.emplace_back([&, i] {
+      try {
+        export_table(database, size, outputDir, tables[i]);
+      } catch (...) {
+        errors[i] = std::current_exception();
+      }
+    });
+  }
+  for (auto &worker : workers) {
+    worker.join();
+  }
+  for (auto &error : errors) {
+    if (error)
+      std::rethrow_exception(error);
+  }
+}
+
+ExportSink::ExportSink(const std::string &outputDir,
+                       std::vector<std::string> tables)
+    : _outputDir(outputDir), _tables(tables), _extracting(false),
+      _inflating(false), _databaseSize(0) {
+  memset(&_stream, 0, sizeof(_stream));
+  make_dir(_outputDir);
+}
+
+ExportSink::~ExportSink() {
+  if (_inflating)
+    inflateEnd(&_stream);
+}
+
+void ExportSink::startMember(const ZipMember &member, bool complete) {
+  _extracting = false;
+  bool isDatabase = false;
+  for (auto &ext : DATABASE_EXTENSIONS) {
+    if (member.name.size() > ext.size() &&
+        member.name.compare(member.name.size() - ext.size(), ext.size(),
+                            ext) == 0) {
+      isDatabase = true;
+    }
+  }
+  if (!isDatabase)
+    return;
+  if (member.method != METHOD_STORED && member.method != METHOD_DEFLATED) {
+    debug("Unsupported compression of %s\n", member.name.c_str());
+    return;
+  }
+
+  // The sizes come from the backup, so they only limit and never size
+  // the buffer
+  if (complete && member.size > MAX_DATABASE_SIZE) {
+    fail("Database too large\n");
+  }
+  _extracting = true;
+  _databaseSize = 0;
+  _database.clear();
+  _database.reserve(std::min(complete ? member.size : 0, MAX_DATABASE_RESERVE));
+  if (member.method == METHOD_DEFLATED) {
+    memset(&_stream, 0, sizeof(_stream));
+    // Raw deflate data, zip has its own header
+    if (inflateInit2(&_stream, -MAX_WBITS) != Z_OK) {
+      fail("Cannot init inflate\n");
+    }
+    _inflating = true;
+  }
+}
+
+void ExportSink::memberData(const char *data, size_t length) {
+  if (!_extracting)
+    return;
+  if (!_inflating) {
+    if (_databaseSize + length > MAX_DATABASE_SIZE) {
+      fail("Database too large\n");
+    }
+    _database.resize(_databaseSize + length);
+    memcpy(_database.data() + _databaseSize, data, length);
+    _databaseSize += length;
+    return;
+  }
+
+  _stream.next_in = reinterpret_cast<Bytef *>(const_cast<char *>(data));
+  _stream.avail_in = length;
+  while (_stream.avail_in > 0) {
+    if (_database.size() == _databaseSize) {
+      if (_databaseSize >= MAX_DATABASE_SIZE) {
+        fail("Database too large\n");
+      }
+      _database.resize(std::min<uint64_t>(
+          std::max<size_t>(_database.size() * 2, 1024 * 1024),
+          MAX_DATABASE_SIZE));
+    }
+    auto available =
+        std::min<size_t>(_database.size() - _databaseSize, UINT32_MAX);
+    _stream.next_out = _database.data() + _databaseSize;
+    _stream.avail_out = available;
+    auto res = inflate(&_stream, Z_NO_FLUSH);
+    _databaseSize += available - _stream.avail_out;
+    if (res == Z_STREAM_END)
+      break;
+    if (res != Z_OK && res != Z_BUF_ERROR) {
+      fail("Cannot inflate database\n");
+    }
+  }
+}
+
+void ExportSink::finishMember(const ZipMember &member) {
+  if (!_extracting)
+    return;
+  if (_inflating) {
+    inflateEnd(&_stream);
+    _inflating = false;
+  }
+  _extracting = false;
+  if (_databaseSize != member.size) {
+    fail("Database size does not match zip header\n");
+  }
+
+  auto name = member.name.substr(member.name.find_last_of('/') + 1);
+  name = name.substr(0, name.find_last_of('.'));
+  if (!is_safe_name(name)) {
+    debug("Skipping database %s\n", member.name.c_str());
+  } else if (_databaseSize > 0) {
+    export_tables(_database.data(), _databaseSize, _outputDir + "/" + name,
+                  _tables);
+  }
+  _database = std::vector<unsigned char>();
+}
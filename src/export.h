@@ -0,0 +1,85 @@
+#ifndef EXPORT_H
+#define EXPORT_H
+
+#include "zip.h"
+#include <exception>
+#include <string>
+#include <vector>
+#include <zlib.h>
+
+/// The tables of Wire's database holding messages and conversations
+const std::vector<std::string> DEFAULT_EXPORT_TABLES = {"ZMESSAGE",
+                                                        "ZCONVERSATION"};
+
+/**
+ * Exports the given tables of an SQLite database held in memory into
+ * column files. Each table is exported in its own thread.
+ *
+ * For every table a directory `<outputDir>/<table>` is created with
+ *  - `schema`: one line per column, "<name> <type>", where type is one of
+ *    int64, double or binary
+ *  - `<index>.col`: the column at the (zero-based) line `index` of the
+ *    schema, split into batches. Each batch is
+ *    uint32 row count, validity bitmap (1 bit per row, least significant
+ *    bit first, 1 = not null) and the values: 8 bytes per row for int64
+ *    and double, or uint64 offsets (rows + 1) followed by the data for
+ *    binary. Numbers are in native byte order.
+ * This is the buffer layout of Arrow arrays (large_binary for binary
+ * columns, so a batch may hold more than 4 GiB of data), so the batches
+ * can be handed to Arrow (or written as Parquet) without converting the
+ * values.
+ *
+ * Tables which do not exist are skipped. Table names must be usable as
+ * directory names.
+ * @param database The content of the database file
+ * @param size The size of the database
+ * @param outputDir The directory to write to
+ * @param tables The names of the tables to export
+ */
+void export_tables(unsigned char *database, size_t size,
+                   const std::string &outputDir,
+                   const std::vector<std::string> &tables);
+
+/**
+ * Sink which extracts the SQLite databases from the decrypted zip into
+ * memory and exports their tables using `export_tables`.
+ * The tables of a database `path/name.ext` are written below
+ * `<outputDir>/name`. Databases whose name cannot be used as a directory
+ * name (e.g. `..`) are skipped. Databases above 2 GiB, or whose size does
+ * not match the zip headers, fail the export.
+ */
+class ExportSink : public ZipSink {
+public:
+  /**
+   * @param outputDir The directory to write to
+   * @param tables The names of the tables to export
+   */
+  ExportSink(const std::string &outputDir,
+             std::vector<std::string> tables = DEFAULT_EXPORT_TABLES);
+  ~ExportSink();
+
+protected:
+  void startMember(const ZipMember &member, bool complete) override;
+  void memberData(const char *data, size_t length) override;
+  void finishMember(const ZipMember &member) override;
+
+private:
+  std::string _outputDir;
+  std::vector<std::string> _tables;
+  bool _extracting;
+  bool _inflating;
+  z_stream _stream;
+  std::vector<unsigned char> _database;
+  size_t _databaseSize;
+};
+
+class ExportException : public std::exception {
+private:
+  std::string _text;
+
+public:
+  inline ExportException(std::string &&text) : _text(text) {}
+  inline virtual const char *what() const throw() { return _text.c_str(); }
+};
+
+#endif // EXPORT_H
@@ -0,0 +1,269 @@
+#include "fileio.h"
+#include <cerrno>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/// Size of the buffers used for small reads and writes
+const size_t IO_BUFFER_SIZE = 64 * 1024;
+/// Number of bytes after which the page cache is cleaned up
+const off_t DROP_WINDOW = 16 * 1024 * 1024;
+
+#define fail(descr)                                                            \
+  debug("%s: %s\n", descr, strerror(errno));                                   \
+  throw IOException(string(descr) + ": " + strerror(errno));
+
+/// Closes the file descriptor when going out of scope
+class FileDescriptor {
+public:
+  FileDescriptor(int fd) : _fd(fd) {}
+  ~FileDescriptor() {
+    if (_fd >= 0)
+      close(_fd);
+  }
+  FileDescriptor(const FileDescriptor &) = delete;
+  FileDescriptor &operator=(const FileDescriptor &) = delete;
+  int get() const { return _fd; }
+
+private:
+  int _fd;
+};
+
+/// Tells the kernel that the given range is not needed anymore
+static void dontneed(int fd, off_t offset, off_t len) {
+#ifdef POSIX_FADV_DONTNEED
+  posix_fadvise(fd, offset, len, POSIX_FADV_DONTNEED);
+#endif
+}
+
+UncachedInputBuf::UncachedInputBuf(int fd)
+    : _fd(fd), _buffer(IO_BUFFER_SIZE), _offset(0), _dropped(0) {
+#ifdef POSIX_FADV_SEQUENTIAL
+  posix_fadvise(_fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+  setg(_buffer.ptr(), _buffer.ptr(), _buffer.ptr());
+}
+
+UncachedInputBuf::~UncachedInputBuf() { dropBehind(true); }
+
+ssize_t UncachedInputBuf::readSome(char *s, size_t n) {
+  ssize_t res;
+  do {
+    res = read(_fd, s, n);
+  } while (res < 0 && errno == EINTR);
+  if (res < 0) {
+    fail("Cannot read input");
+  }
+  _offset += res;
+  dropBehind(false);
+  return res;
+}
+
+void UncachedInputBuf::dropBehind(bool all) {
+  if (all || _offset - _dropped >= DROP_WINDOW) {
+    dontneed(_fd, _dropped, _offset - _dropped);
+    _dropped = _offset;
+  }
+}
+
+UncachedInputBuf::int_type UncachedInputBuf::underflow() {
+  if (gptr() < egptr()) {
+    return traits_type::to_int_type(*gptr());
+  }
+  auto res = readSome(_buffer.ptr(), _buffer.size());
+  if (res == 0) {
+    return traits_type::eof();
+  }
+  setg(_buffer.ptr(), _buffer.ptr(), _buffer.ptr() + res);
+  return traits_type::to_int_type(*gptr());
+}
+
+std::streamsize UncachedInputBuf::xsgetn(char *s, std::streamsize n) {
+  std::streamsize total = 0;
+  // Serve what is still buffered first
+  auto buffered = std::min<std::streamsize>(egptr() - gptr(), n);
+  if (buffered > 0) {
+    memcpy(s, gptr(), buffered);
+    gbump(buffered);
+    total += buffered;
+  }
+  // Large reads go directly into the destination
+  while (total < n) {
+    if (n - total < static_cast<std::streamsize>(_buffer.size())) {
+      if (underflow() == traits_type::eof())
+        break;
+      auto len = std::min<std::streamsize>(egptr() - gptr(), n - total);
+      memcpy(s + total, gptr(), len);
+      gbump(len);
+      total += len;
+      continue;
+    }
+    auto res = readSome(s + total, n - total);
+    if (res == 0)
+      break;
+    total += res;
+  }
+  return total;
+}
+
+UncachedOutputBuf::UncachedOutputBuf(int fd)
+    : _fd(fd), _buffer(IO_BUFFER_SIZE), _offset(0), _started(0), _dropped(0) {
+  setp(_buffer.ptr(), _buffer.ptr() + _buffer.size());
+}
+
+UncachedOutputBuf::~UncachedOutputBuf() {
+  try {
+    flushBuffer();
+    dropBehind(true);
+  } catch (IOException &) {
+  }
+}
+
+uint64_t UncachedOutputBuf::written() const {
+  return _offset + (pptr() - pbase());
+}
+
+void UncachedOutputBuf::writeAll(const char *s, size_t n) {
+  while (n > 0) {
+    auto res = write(_fd, s, n);
+    if (res < 0 && errno == EINTR)
+      continue;
+    if (res < 0) {
+      fail("Cannot write output");
+    }
+    s += res;
+    n -= res;
+    _offset += res;
+  }
+  dropBehind(false);
+}
+
+void UncachedOutputBuf::flushBuffer() {
+  if (pptr() > pbase()) {
+    writeAll(pbase(), pptr() - pbase());
+    setp(_buffer.ptr(), _buffer.ptr() + _buffer.size());
+  }
+}
+
+void UncachedOutputBuf::dropBehind(bool all) {
+#ifdef __linux__
+  // Start writing back the latest window, then wait for the previous one
+  // and drop it. So the disk is kept busy while we never wait for
+  // the data we just wrote.
+  if (all) {
+    sync_file_range(_fd, _dropped, _offset - _dropped,
+                    SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                        SYNC_FILE_RANGE_WAIT_AFTER);
+    dontneed(_fd, _dropped, _offset - _dropped);
+    _dropped = _started = _offset;
+  } else if (_offset - _started >= DROP_WINDOW) {
+    sync_file_range(_fd, _started, _offset - _started, SYNC_FILE_RANGE_WRITE);
+    if (_started > _dropped) {
+      sync_file_range(_fd, _dropped, _started - _dropped,
+                      SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                          SYNC_FILE_RANGE_WAIT_AFTER);
+      dontneed(_fd, _dropped, _started - _dropped);
+      _dropped = _started;
+    }
+    _started = _offset;
+  }
+#else
+  // Dirty pages cannot be dropped, so we need to sync them first
+  if (all || _offset - _dropped >= DROP_WINDOW) {
+    fdatasync(_fd);
+    dontneed(_fd, _dropped, _offset - _dropped);
+    _dropped = _started = _offset;
+  }
+#endif
+}
+
+UncachedOutputBuf::int_type UncachedOutputBuf::overflow(int_type ch) {
+  flushBuffer();
+  if (!traits_type::eq_int_type(ch, traits_type::eof())) {
+    *pptr() = traits_type::to_char_type(ch);
+    pbump(1);
+  }
+  return traits_type::not_eof(ch);
+}
+
+std::streamsize UncachedOutputBuf::xsputn(const char *s, std::streamsize n) {
+  if (n < epptr() - pptr()) {
+    memcpy(pptr(), s, n);
+    pbump(n);
+    return n;
+  }
+  // Large writes bypass the buffer
+  flushBuffer();
+  writeAll(s, n);
+  return n;
+}
+
+int UncachedOutputBuf::sync() {
+  flushBuffer();
+  return 0;
+}
+
+UncachedOutputBuf::pos_type
+UncachedOutputBuf::seekoff(off_type off, std::ios_base::seekdir dir,
+                           std::ios_base::openmode which) {
+  // Only telling the current position is supported
+  if (off != 0 || dir != std::ios_base::cur || !(which & std::ios_base::out)) {
+    return pos_type(off_type(-1));
+  }
+  return pos_type(written());
+}
+
+uint64_t decrypt_file(const std::string &inputPath,
+                      const std::string &outputPath, Password password,
+                      std::vector<ChunkSink *> sinks) {
+  FileDescriptor in(open(inputPath.c_str(), O_RDONLY | O_CLOEXEC));
+  if (in.get() < 0) {
+    fail("Cannot open input");
+  }
+  struct stat st;
+  if (fstat(in.get(), &st) != 0) {
+    fail("Cannot stat input");
+  }
+
+  FileDescriptor out(
+      open(outputPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644));
+  if (out.get() < 0) {
+    fail("Cannot open output");
+  }
+
+  // Reserve the whole output at once to avoid a fragmented file. The size
+  // is kept, so a failed decryption does not leave a complete looking file.
+  // Not every filesystem supports this, so failures are ignored.
+  auto expected = plaintext_size(st.st_size);
+#ifdef __linux__
+  if (expected > 0 &&
+      fallocate(out.get(), FALLOC_FL_KEEP_SIZE, 0, expected) != 0) {
+    debug("Cannot preallocate output: %s\n", strerror(errno));
+  }
+#endif
+
+  UncachedInputBuf inbuf(in.get());
+  UncachedOutputBuf outbuf(out.get());
+  std::istream input(&inbuf);
+  std::ostream output(&outbuf);
+  StreamSink file(output);
+  sinks.insert(sinks.begin(), &file);
+  try {
+    FanOutSink fanout(sinks);
+    decrypt(input, fanout, password);
+    outbuf.pubsync();
+  } catch (...) {
+    // Release the preallocated space behind what was written so far
+    if (fstat(out.get(), &st) == 0 && ftruncate(out.get(), st.st_size) != 0) {
+      debug("Cannot truncate output: %s\n", strerror(errno));
+    }
+    throw;
+  }
+
+  // Release what was preallocated but not written
+  auto written = outbuf.written();
+  if (ftruncate(out.get(), written) != 0) {
+    fail("Cannot truncate output");
+  }
+  return written;
+}
@@ -0,0 +1,99 @@
+#ifndef FILEIO_H
+#define FILEIO_H
+
+#include "crypto.h"
+#include <exception>
+#include <streambuf>
+#include <string>
+#include <sys/types.h>
+
+/**
+ * Input stream buffer reading from a file descriptor.
+ * Pages which were already consumed are dropped from the page cache,
+ * so that reading a huge backup does not evict other data.
+ */
+class UncachedInputBuf : public std::streambuf {
+public:
+  /**
+   * @param fd An open file descriptor. It is not closed by this buffer.
+   */
+  UncachedInputBuf(int fd);
+  ~UncachedInputBuf();
+
+protected:
+  int_type underflow() override;
+  std::streamsize xsgetn(char *s, std::streamsize n) override;
+
+private:
+  ssize_t readSome(char *s, size_t n);
+  void dropBehind(bool all);
+
+  int _fd;
+  Bytes _buffer;
+  off_t _offset;
+  off_t _dropped;
+};
+
+/**
+ * Output stream buffer writing to a file descriptor.
+ * Written pages are flushed to disk in the background and
+ * dropped from the page cache afterwards.
+ */
+class UncachedOutputBuf : public std::streambuf {
+public:
+  /**
+   * @param fd An open file descriptor. It is not closed by this buffer.
+   */
+  UncachedOutputBuf(int fd);
+  ~UncachedOutputBuf();
+
+  /**
+   * Returns the number of bytes written to the file descriptor
+   * (including the ones still in the buffer).
+   */
+  uint64_t written() const;
+
+protected:
+  int_type overflow(int_type ch) override;
+  std::streamsize xsputn(const char *s, std::streamsize n) override;
+  int sync() override;
+  pos_type seekoff(off_type off, std::ios_base::seekdir dir,
+                   std::ios_base::openmode which) override;
+
+private:
+  void writeAll(const char *s, size_t n);
+  void flushBuffer();
+  void dropBehind(bool all);
+
+  int _fd;
+  Bytes _buffer;
+  off_t _offset;
+  off_t _started;
+  off_t _dropped;
+};
+
+/**
+ * Decrypts the file at `inputPath` to `outputPath` without polluting the
+ * page cache. The output file is preallocated with the exact size of the
+ * decrypted data before writing, which avoids fragmentation.
+ * @param inputPath The path to the encrypted backup
+ * @param outputPath The path where the decrypted data should be written at
+ * @param password The password for decrypting
+ * @param sinks Further sinks which receive the decrypted data
+ * alongside the file
+ * @return The length of the written data
+ */
+uint64_t decrypt_file(const std::string &inputPath,
+                      const std::string &outputPath, Password password,
+                      std::vector<ChunkSink *> sinks = {});
+
+class IOException : public std::exception {
+private:
+  std::string _text;
+
+public:
+  inline IOException(std::string &&text) : _text(text) {}
+  inline virtual const char *what() const throw() { return _text.c_str(); }
+};
+
+#endif // FILEIO_H
@@ -1,4 +1,13 @@
 #include "crypto.h"
+#include "fileio.h"
+#include "zipdiff.h"
+#ifdef HAVE_EXPORT
+#include "export.h"
+#endif
+#ifdef HAVE_WORKER
+#include "worker.h"
+#endif
+#include <cstdio>
 #include <exception>
 #include <fstream>
 #include <iostream>
@@ -25,29 +34,177 @@ int main(int argc, char **argv) {
     return -1;
   }
 
-  if (argc != 4) {
-    cout << argv[0] << " input-file output-file password" << endl;
+  // Leading options
+  bool noCache = false;
+  bool rekeying = false;
+  bool diffing = false;
+  bool exporting = false;
+  bool isolated = false;
+  vector<unique_ptr<DigestSink>> digests;
+  int argi = 1;
+  for (; argi < argc && string(argv[argi]).rfind("--", 0) == 0; argi++) {
+    if (string(argv[argi]) == "--rekey") {
+      rekeying = true;
+    } else if (string(argv[argi]) == "--diff") {
+      diffing = true;
+#ifdef HAVE_EXPORT
+    } else if (string(argv[argi]) == "--export") {
+      exporting = true;
+#endif
+#ifdef HAVE_WORKER
+    } else if (string(argv[argi]) == "--isolated") {
+      isolated = true;
+#endif
+    } else if (string(argv[argi]) == "--no-cache") {
+      noCache = true;
+    } else if (string(argv[argi]) == "--sha256") {
+      digests.emplace_back(new Sha256Sink());
+    } else if (string(argv[argi]) == "--blake2b") {
+      digests.emplace_back(new Blake2bSink());
+    } else {
+      cerr << "Unknown option " << argv[argi] << endl;
+      return -1;
+    }
+  }
+
+  // At most one mode, and the plain decrypt options only without one
+  int modes = rekeying + diffing + exporting + isolated;
+  if (modes > 1 || (modes == 1 && (noCache || !digests.empty()))) {
+    cerr << "Conflicting options" << endl;
+    return -1;
+  }
+
+  auto jobs = argc - argi;
+  if (isolated ? (jobs == 0 || jobs % 3 != 0) : jobs != (rekeying ? 5 : 3)) {
+    cout << argv[0]
+         << " [--no-cache] [--sha256] [--blake2b] input-file output-file "
+            "password"
+         << endl;
+    cout << argv[0]
+         << " --rekey input-file output-file old-password new-password uuid"
+         << endl;
+    cout << argv[0] << " --diff input-file store-dir password" << endl;
+#ifdef HAVE_EXPORT
+    cout << argv[0] << " --export input-file output-dir password" << endl;
+#endif
+#ifdef HAVE_WORKER
+    cout << argv[0]
+         << " --isolated input-file output-file password [input-file "
+            "output-file password ...]"
+         << endl;
+#endif
     return -1;
   }
 
-  auto inp = argv[1];
-  auto outp = argv[2];
-  auto pass = argv[3];
-  auto uuid = "";
-  if (argc == 5) {
-    uuid = argv[4];
+#ifdef HAVE_WORKER
+  if (isolated) {
+    // Every backup is decrypted by its own worker, a failing one does not
+    // affect the others
+    int failed = 0;
+    for (; argi < argc; argi += 3) {
+      auto inp = argv[argi];
+      auto outp = argv[argi + 1];
+      try {
+        auto o = ofstream(outp);
+        StreamSink file(o);
+        auto res = decrypt_isolated(inp, file, Password{argv[argi + 2], ""});
+        if (res.success) {
+          cout << inp << ": decrypted " << res.size << " bytes" << endl;
+          continue;
+        }
+        cerr << inp << ": failure: " << res.error << endl;
+      } catch (exception &e) {
+        cerr << inp << ": failure: " << e.what() << endl;
+      }
+      remove(outp);
+      failed++;
+    }
+    return failed == 0 ? 0 : 1;
   }
+#endif
+
+  if (rekeying) {
+    try {
+      auto i = ifstream(argv[argi]);
+      auto o = ofstream(argv[argi + 1]);
+      cout << "Start rekeying" << endl;
+      rekey(i, o, Password{argv[argi + 2], ""},
+            Password{argv[argi + 3], argv[argi + 4]});
+      cout << "Rekeying sucessfully" << endl;
+    } catch (exception &e) {
+      cerr << "Failure: " << e.what() << endl;
+      return 1;
+    }
+    return 0;
+  }
+
+  if (diffing) {
+    try {
+      auto i = ifstream(argv[argi]);
+      ZipDiffSink diff(argv[argi + 1]);
+      cout << "Start decrypting" << endl;
+      decrypt(i, diff, Password{argv[argi + 2], ""});
+      cout << "Decrypting sucessfully" << endl;
+      auto &stats = diff.stats();
+      cout << stats.added << " added, " << stats.changed << " changed, "
+           << stats.unchanged << " unchanged, " << stats.removed
+           << " removed" << endl;
+    } catch (exception &e) {
+      cerr << "Failure: " << e.what() << endl;
+      return 1;
+    }
+    return 0;
+  }
+
+#ifdef HAVE_EXPORT
+  if (exporting) {
+    try {
+      auto i = ifstream(argv[argi]);
+      ExportSink exporter(argv[argi + 1]);
+      cout << "Start decrypting" << endl;
+      decrypt(i, exporter, Password{argv[argi + 2], ""});
+      cout << "Decrypting and exporting sucessfully" << endl;
+    } catch (exception &e) {
+      cerr << "Failure: " << e.what() << endl;
+      return 1;
+    }
+    return 0;
+  }
+#endif
+
+  auto inp = argv[argi];
+  auto outp = argv[argi + 1];
+  auto pass = argv[argi + 2];
+  auto uuid = "";
 
-  auto i = ifstream(inp);
-  auto o = ofstream(outp);
+  // Digests are computed while writing, so the output is not read again
+  vector<ChunkSink *> sinks;
+  for (auto &digest : digests) {
+    sinks.push_back(digest.get());
+  }
 
   Password p{string(pass), uuid};
   try {
     cout << "Start decrypting" << endl;
-    decrypt(i, o, p);
+    if (noCache) {
+      decrypt_file(inp, outp, p, sinks);
+    } else {
+      auto i = ifstream(inp);
+      auto o = ofstream(outp);
+      StreamSink file(o);
+      sinks.insert(sinks.begin(), &file);
+      FanOutSink fanout(sinks);
+      decrypt(i, fanout, p);
+    }
     cout << "Decrypting sucessfully" << endl;
+    for (auto &digest : digests) {
+      cout << digest->name() << " (" << outp << ") = " << digest->hex()
+           << endl;
+    }
   } catch (exception &e) {
     cerr << "Failure: " << e.what() << endl;
+    return 1;
   }
+  return 0;
 }
 #endif
@@ -0,0 +1,23 @@
+#ifndef PROBES_H
+#define PROBES_H
+
+/**
+ * Static tracepoints (USDT) of the provider "wire_decrypt".
+ * They are only compiled in with the meson option `usdt`. Even then,
+ * a probe is a single nop as long as no tracer is attached, e.g.
+ *   bpftrace -e 'usdt:./decrypt:wire_decrypt:chunk__pull__done { ... }'
+ */
+#ifdef HAVE_USDT
+#include <sys/sdt.h>
+#define PROBE0(name) DTRACE_PROBE(wire_decrypt, name)
+#define PROBE1(name, a) DTRACE_PROBE1(wire_decrypt, name, a)
+#define PROBE2(name, a, b) DTRACE_PROBE2(wire_decrypt, name, a, b)
+#define PROBE3(name, a, b, c) DTRACE_PROBE3(wire_decrypt, name, a, b, c)
+#else
+#define PROBE0(name)
+#define PROBE1(name, a)
+#define PROBE2(name, a, b)
+#define PROBE3(name, a, b, c)
+#endif
+
+#endif // PROBES_H
@@ -0,0 +1,158 @@
+#include "sink.h"
+#include <sodium/utils.h>
+
+void StreamSink::consume(const char *data, size_t length) {
+  if (!_output.write(data, length)) {
+    throw SinkException("Cannot write output");
+  }
+}
+
+void StreamSink::finish() {
+  if (!_output.flush()) {
+    throw SinkException("Cannot flush output");
+  }
+}
+
+std::string DigestSink::hex() const {
+  auto &bin = digest();
+  std::string res(bin.size() * 2 + 1, '\0');
+  sodium_bin2hex(&res[0], res.size(), bin.ptr_unsigned_const(), bin.size());
+  res.pop_back();
+  return res;
+}
+
+Sha256Sink::Sha256Sink() { crypto_hash_sha256_init(&_state); }
+
+void Sha256Sink::consume(const char *data, size_t length) {
+  crypto_hash_sha256_update(
+      &_state, reinterpret_cast<const unsigned char *>(data), length);
+}
+
+void Sha256Sink::finish() {
+  _digest = Bytes(crypto_hash_sha256_BYTES);
+  crypto_hash_sha256_final(&_state, _digest.ptr_unsigned());
+}
+
+Blake2bSink::Blake2bSink() {
+  crypto_generichash_blake2b_init(&_state, nullptr, 0,
+                                  crypto_generichash_blake2b_BYTES);
+}
+
+void Blake2bSink::consume(const char *data, size_t length) {
+  crypto_generichash_blake2b_update(
+      &_state, reinterpret_cast<const unsigned char *>(data), length);
+}
+
+void Blake2bSink::finish() {
+  _digest = Bytes(crypto_generichash_blake2b_BYTES);
+  crypto_generichash_blake2b_final(&_state, _digest.ptr_unsigned(),
+                                   _digest.size());
+}
+
+FanOutSink::FanOutSink(std::vector<ChunkSink *> sinks)
+    : _sinks(sinks), _data(nullptr), _length(0), _generation(0), _pending(0),
+      _stop(false) {
+  // The first sink runs in the calling thread
+  for (size_t i = 1; i < _sinks.size(); i++) {
+    _workers.emplace_back(&FanOutSink::work, this, i);
+  }
+}
+
+FanOutSink::~FanOutSink() {
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _stop = true;
+  }
+  _started.notify_all();
+  for (auto &worker : _workers) {
+    worker.join();
+  }
+}
+
+void FanOutSink::work(size_t idx) {
+  uint64_t seen = 0;
+  while (true) {
+    std::unique_lock<std::mutex> lock(_mutex);
+    _started.wait(lock, [&] { return _stop || _generation != seen; });
+    if (_stop)
+      return;
+    seen = _generation;
+    auto data = _data;
+    auto length = _length;
+    lock.unlock();
+
+    std::exception_ptr error;
+    try {
+      if (data) {
+        _sinks[idx]->consume(data, length);
+      } else {
+        _sinks[idx]->finish();
+      }
+    } catch (...) {
+      error = std::current_exception();
+    }
+
+    lock.lock();
+    if (error && !_error)
+      _error = error;
+    if (--_pending == 0)
+      _done.notify_one();
+  }
+}
+
+void FanOutSink::waitForWorkers() {
+  std::unique_lock<std::mutex> lock(_mutex);
+  _done.wait(lock, [&] { return _pending == 0; });
+  if (_error) {
+    auto error = _error;
+    _error = nullptr;
+    std::rethrow_exception(error);
+  }
+}
+
+void FanOutSink::consume(const char *data, size_t length) {
+  if (_sinks.empty())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _data = data;
+    _length = length;
+    _pending = _workers.size();
+    _generation++;
+  }
+  _started.notify_all();
+
+  std::exception_ptr error;
+  try {
+    _sinks[0]->consume(data, length);
+  } catch (...) {
+    error = std::current_exception();
+  }
+  // The buffer must not be touched after we return
+  waitForWorkers();
+  if (error)
+    std::rethrow_exception(error);
+}
+
+void FanOutSink::finish() {
+  if (_sinks.empty())
+    return;
+  {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _data = nullptr;
+    _length = 0;
+    _pending = _workers.size();
+    _generation++;
+  }
+  _started.notify_all();
+
+  std::exception_ptr error;
+  try {
+    _sinks[0]->finish();
+  } catch (...) {
+    error = std::current_exception();
+  }
+  waitForWorkers();
+  if (error)
+    std::rethrow_exception(error);
+}
@@ -0,0 +1,143 @@
+#ifndef SINK_H
+#define SINK_H
+
+#include "utils.h"
+#include <condition_variable>
+#include <exception>
+#include <mutex>
+#include <ostream>
+#include <sodium/crypto_generichash_blake2b.h>
+#include <sodium/crypto_hash_sha256.h>
+#include <string>
+#include <thread>
+#include <vector>
+
+using Bytes = DynamicArray<char>;
+
+/**
+ * Consumer of the decrypted data.
+ * The data is handed over chunk by chunk. The buffer is only valid
+ * during the call to `consume`.
+ */
+class ChunkSink {
+public:
+  virtual ~ChunkSink() {}
+  /**
+   * Consume the next decrypted chunk
+   * @param data The decrypted data
+   * @param length The length of data
+   */
+  virtual void consume(const char *data, size_t length) = 0;
+  /**
+   * Optionally provides the memory the next chunk is decrypted into.
+   * `consume` then receives this very buffer, so the chunk is not copied.
+   * @param length The size the buffer needs to have
+   * @return The buffer or nullptr to use an internal one
+   */
+  virtual char *buffer(size_t /*length*/) { return nullptr; }
+  /**
+   * Called after the last chunk was consumed
+   */
+  virtual void finish() {}
+};
+
+/**
+ * Writes the decrypted data to a stream
+ */
+class StreamSink : public ChunkSink {
+private:
+  std::ostream &_output;
+
+public:
+  StreamSink(std::ostream &output) : _output(output) {}
+  void consume(const char *data, size_t length) override;
+  void finish() override;
+};
+
+/**
+ * A sink computing a digest over the decrypted data
+ */
+class DigestSink : public ChunkSink {
+public:
+  /**
+   * Name of the algorithm, e.g. "SHA256"
+   */
+  virtual std::string name() const = 0;
+  /**
+   * The digest. Only valid after `finish()` was called.
+   */
+  virtual const Bytes &digest() const = 0;
+  /**
+   * The digest as lowercase hex string
+   */
+  std::string hex() const;
+};
+
+class Sha256Sink : public DigestSink {
+private:
+  crypto_hash_sha256_state _state;
+  Bytes _digest;
+
+public:
+  Sha256Sink();
+  void consume(const char *data, size_t length) override;
+  void finish() override;
+  std::string name() const override { return "SHA256"; }
+  const Bytes &digest() const override { return _digest; }
+};
+
+class Blake2bSink : public DigestSink {
+private:
+  crypto_generichash_blake2b_state _state;
+  Bytes _digest;
+
+public:
+  Blake2bSink();
+  void consume(const char *data, size_t length) override;
+  void finish() override;
+  std::string name() const override { return "BLAKE2b"; }
+  const Bytes &digest() const override { return _digest; }
+};
+
+/**
+ * Hands every chunk to several sinks at once.
+ * The sinks run concurrently, each one in its own thread, on the very same
+ * buffer. `consume` returns when all sinks are done with the chunk.
+ */
+class FanOutSink : public ChunkSink {
+public:
+  /**
+   * @param sinks The sinks to feed. They must outlive this object.
+   */
+  FanOutSink(std::vector<ChunkSink *> sinks);
+  ~FanOutSink();
+  void consume(const char *data, size_t length) override;
+  void finish() override;
+
+private:
+  void work(size_t idx);
+  void waitForWorkers();
+
+  std::vector<ChunkSink *> _sinks;
+  std::vector<std::thread> _workers;
+  std::mutex _mutex;
+  std::condition_variable _started;
+  std::condition_variable _done;
+  const char *_data;
+  size_t _length;
+  uint64_t _generation;
+  size_t _pending;
+  bool _stop;
+  std::exception_ptr _error;
+};
+
+class SinkException : public std::exception {
+private:
+  std::string _text;
+
+public:
+  inline SinkException(std::string &&text) : _text(text) {}
+  inline virtual const char *what() const throw() { return _text.c_str(); }
+};
+
+#endif // SINK_H
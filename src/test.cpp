@@ -1,9 +1,22 @@
 #include "test.h"
 #include "backupheader.h"
 #include "crypto.h"
+#include "fileio.h"
+#include "zipdiff.h"
+#ifdef HAVE_EXPORT
+#include "export.h"
+#endif
+#ifdef HAVE_WORKER
+#include "worker.h"
+#endif
+#include <algorithm>
 #include <array>
+#include <dirent.h>
+#include <fstream>
 #include <iostream>
 #include <sstream>
+#include <sys/stat.h>
+#include <unistd.h>
 #include <vector>
 
 /**
@@ -16,6 +29,11 @@ using namespace std;
 const char *header =
     "V0JVSQAAAQ8CgQ/"
     "ikb7pIkWDhhDkY7uMxemLjGnPNJ2ohITEekzYAzAxygPF36PpKw9HXrGZWg==";
+/// "123456789" encrypted with the password "1235678"
+static const char *msg =
+    "V0JVSQAAAT5xxW76YX91IgLvJwXeC5x+q/"
+    "8To15mBzbsA6rc5Dzf7xRyWH+LYv+bscKxj3c7Fl7trr/"
+    "9qt78lgA5ZtyjK7d2ZBdSYl4HLskPjyUIseTjAZjGKt+7MEXp8aVBey8ooGep";
 
 // https://stackoverflow.com/questions/180947/base64-decode-snippet-in-c
 static std::vector<char> base64_decode(const std::string &in) {
@@ -58,9 +76,10 @@ bool test_header() {
   auto header_data = base64_decode(header);
   Bytes buffer(header_data);
   BackupHeader header(std::move(buffer));
+  BackupHeaderEntries entries = header.entries();
   const std::array<unsigned char, 16> SALT{
       {15, 2, 129, 15, 226, 145, 190, 233, 34, 69, 131, 134, 16, 228, 99, 187}};
-  if (!assert_array<unsigned char, 16>(header.entries().salt.to_unsigned(),
+  if (!assert_array<unsigned char, 16>(entries.salt.to_unsigned(),
                                        SALT)) {
     return false;
   }
@@ -69,7 +88,14 @@ bool test_header() {
        132, 196, 122, 76,  216, 3,   48,  49,  202, 3,   197,
        223, 163, 233, 43,  15,  71,  94,  177, 153, 90}};
   return assert_array<unsigned char, 32>(
-      header.entries().uuidhash.to_unsigned(), UUHASH);
+      entries.uuidhash.to_unsigned(), UUHASH);
+}
+
+bool test_header_serialize() {
+  auto header_data = base64_decode(header);
+  Bytes buffer(header_data);
+  BackupHeader header(buffer.clone());
+  return header.serialize() == buffer;
 }
 
 struct membuf : std::streambuf {
@@ -77,13 +103,10 @@ struct membuf : std::streambuf {
 };
 
 bool test_msg() {
-  auto msg = base64_decode(
-      "V0JVSQAAAT5xxW76YX91IgLvJwXeC5x+q/"
-      "8To15mBzbsA6rc5Dzf7xRyWH+LYv+bscKxj3c7Fl7trr/"
-      "9qt78lgA5ZtyjK7d2ZBdSYl4HLskPjyUIseTjAZjGKt+7MEXp8aVBey8ooGep");
+  auto encrypted = base64_decode(msg);
   auto password = "1235678";
 
-  membuf buf(msg.data(), msg.data() + msg.size());
+  membuf buf(encrypted.data(), encrypted.data() + encrypted.size());
   istream inp(&buf);
   auto outp = ostringstream();
 
@@ -91,6 +114,247 @@ bool test_msg() {
   return outp.str() == "123456789";
 }
 
+bool test_msg_file() {
+  auto encrypted = base64_decode(msg);
+  if (plaintext_size(encrypted.size()) != 9) {
+    return false;
+  }
+
+  char inpPath[] = "/tmp/wire-decrypt-inXXXXXX";
+  char outpPath[] = "/tmp/wire-decrypt-outXXXXXX";
+  close(mkstemp(inpPath));
+  close(mkstemp(outpPath));
+  ofstream(inpPath).write(encrypted.data(), encrypted.size());
+
+  // A failed decryption must not leave a preallocated, complete looking file
+  struct stat st;
+  try {
+    decrypt_file(inpPath, outpPath, Password{"wrong", ""});
+    return false;
+  } catch (CryptoException &) {
+  }
+  if (stat(outpPath, &st) != 0 || st.st_size != 0) {
+    return false;
+  }
+
+  auto written = decrypt_file(inpPath, outpPath, Password{"1235678", ""});
+  stringstream content;
+  content << ifstream(outpPath).rdbuf();
+  unlink(inpPath);
+  unlink(outpPath);
+  return written == 9 && content.str() == "123456789";
+}
+
+bool test_msg_sinks() {
+  auto encrypted = base64_decode(msg);
+
+  membuf buf(encrypted.data(), encrypted.data() + encrypted.size());
+  istream inp(&buf);
+  auto outp = ostringstream();
+  StreamSink file(outp);
+  Sha256Sink sha256;
+  Blake2bSink blake2b;
+  FanOutSink fanout({&file, &sha256, &blake2b});
+
+  decrypt(inp, fanout, Password{"1235678", ""});
+  return outp.str() == "123456789" &&
+         sha256.hex() == "15e2b0d3c33891ebb0f1ef609ec419420c20e320ce94c65fbc8"
+                         "c3312448eb225" &&
+         blake2b.hex() == "16e0bf1f85594a11e75030981c0b670370b3ad83a43f49ae58"
+                          "a2fd6f6513cde9";
+}
+
+bool test_rekey() {
+  auto encrypted = base64_decode(msg);
+
+  membuf buf(encrypted.data(), encrypted.data() + encrypted.size());
+  istream inp(&buf);
+  auto rekeyed = stringstream();
+  rekey(inp, rekeyed, Password{"1235678", ""}, Password{"87654321", ""});
+  if (rekeyed.str().size() != encrypted.size()) {
+    return false;
+  }
+
+  auto outp = ostringstream();
+  decrypt(rekeyed, outp, Password{"87654321", ""});
+  return outp.str() == "123456789";
+}
+
+/// Feeds `zip` in small pieces to a ZipDiffSink on `store`
+static ZipDiffStats diff_zip(const std::vector<char> &zip,
+                             const std::string &store) {
+  ZipDiffSink sink(store);
+  for (size_t i = 0; i < zip.size(); i += 7) {
+    sink.consume(zip.data() + i, std::min<size_t>(7, zip.size() - i));
+  }
+  sink.finish();
+  return sink.stats();
+}
+
+static void remove_dir(const std::string &path) {
+  auto dir = opendir(path.c_str());
+  while (auto entry = readdir(dir)) {
+    std::string name = entry->d_name;
+    if (name == "." || name == "..")
+      continue;
+    if (entry->d_type == DT_DIR) {
+      remove_dir(path + "/" + name);
+    } else {
+      unlink((path + "/" + name).c_str());
+    }
+  }
+  closedir(dir);
+  rmdir(path.c_str());
+}
+
+bool test_zip_diff() {
+  // a.txt (stored), b.txt (deflated), c.txt
+  auto first = base64_decode(
+      "UEsDBBQAAAAAAAAAIQCGphA2BQAAAAUAAAAFAAAAYS50eHRoZWxsb1BLAwQUAAAACAAh"
+      "kFJdlgy1mwoAAAD6AAAABQAAAGIudHh0K88vykkpH4kEAFBLAwQUAAAAAAAhkFJdA5WU"
+      "vQsAAAALAAAABQAAAGMudHh0UEsHCCB0cmlja3lQSwECFAMUAAAAAAAAACEAhqYQNgUA"
+      "AAAFAAAABQAAAAAAAAAAAAAAgAEAAAAAYS50eHRQSwECFAMUAAAACAAhkFJdlgy1mwoA"
+      "AAD6AAAABQAAAAAAAAAAAAAAgAEoAAAAYi50eHRQSwECFAMUAAAAAAAhkFJdA5WUvQsA"
+      "AAALAAAABQAAAAAAAAAAAAAAgAFVAAAAYy50eHRQSwUGAAAAAAMAAwCZAAAAgwAAAAAA");
+  // a.txt unchanged, b.txt changed, c.txt removed; written with data
+  // descriptors and b.txt containing a descriptor signature
+  auto second = base64_decode(
+      "UEsDBBQACAAAAAAAIQAAAAAAAAAAAAAAAAAFAAAAYS50eHRoZWxsb1BLBwiGphA2BQAA"
+      "AAUAAABQSwMEFAAIAAAAAAAhAAAAAAAAAAAAAAAAAAUAAABiLnR4dFBLBwh3b3JsZCFQ"
+      "SwcI0Q01/woAAAAKAAAAUEsBAhQDFAAIAAAAAAAhAIamEDYFAAAABQAAAAUAAAAAAAAA"
+      "AAAAAIABAAAAAGEudHh0UEsBAhQDFAAIAAAAAAAhANENNf8KAAAACgAAAAUAAAAAAAAA"
+      "AAAAAIABOAAAAGIudHh0UEsFBgAAAAACAAIAZgAAAHUAAAAAAA==");
+
+  char storePath[] = "/tmp/wire-decrypt-storeXXXXXX";
+  std::string store = mkdtemp(storePath);
+  auto run1 = diff_zip(first, store);
+  auto run2 = diff_zip(first, store);
+  auto run3 = diff_zip(second, store);
+  std::ifstream object(store + "/objects/ff350dd1-10-10-0");
+  std::string content((std::istreambuf_iterator<char>(object)),
+                      std::istreambuf_iterator<char>());
+  remove_dir(store);
+
+  return run1.added == 3 && run1.unchanged == 0 && run2.unchanged == 3 &&
+         run2.added == 0 && run3.unchanged == 1 && run3.changed == 1 &&
+         run3.removed == 1 && content == std::string("PK\x07\x08world!");
+}
+
+#ifdef HAVE_EXPORT
+bool test_export() {
+  // export.json and data/store.wiredatabase with ZMESSAGE
+  // (Z_PK INTEGER, ZTEXT VARCHAR, ZTIMESTAMP TIMESTAMP) = (1, "hi", 1.5),
+  // (2, NULL, 2.5) in WAL mode
+  auto zip = base64_decode(
+      "UEsDBBQAAAAIAK6QUl1Dv6ajBAAAAAIAAAALAAAAZXhwb3J0Lmpzb26rrgUAUEsDBBQA"
+      "AAAIAK6QUl18Uq8TtwAAAAAEAAAXAAAAZGF0YS9zdG9yZS53aXJlZGF0YWJhc2ULDvTJ"
+      "LElVSMsvyk0sUTBmYGJgYmJwUFBgYAAyIRgGGIGYBY1PCDAx6CUz8oIUM/YwANEowAOK"
+      "GNnFZWUZG81LEpNyUqN8XYODHd1dYTSTc5CrY4irQoijk4+rAkxUQSMqPsBbwdMvxNXd"
+      "NUghIMjT1zEoUsHbNVJHISrENSJEIcwxyNnDMQjE9QRqCnH0DVCAszRBccPE+IiB8QOQ"
+      "GAXDEPAwATMtuwM05/IxsjAIsmdk2v+A8AFQSwECFAMUAAAACACukFJdQ7+mowQAAAAC"
+      "AAAACwAAAAAAAAAAAAAAgAEAAAAAZXhwb3J0Lmpzb25QSwECFAMUAAAACACukFJdfFKv"
+      "E7cAAAAABAAAFwAAAAAAAAAAAAAAgAEtAAAAZGF0YS9zdG9yZS53aXJlZGF0YWJhc2VQ"
+      "SwUGAAAAAAIAAgB+AAAAGQEAAAAA");
+
+  auto run = [](const std::vector<char> &zip, const std::string &out) {
+    ExportSink sink(out);
+    for (size_t i = 0; i < zip.size(); i += 100) {
+      sink.consume(zip.data() + i, std::min<size_t>(100, zip.size() - i));
+    }
+    sink.finish();
+  };
+  auto read = [](const std::string &path) {
+    std::ifstream file(path, std::ios::binary);
+    return std::string((std::istreambuf_iterator<char>(file)),
+                       std::istreambuf_iterator<char>());
+  };
+
+  char outPath[] = "/tmp/wire-decrypt-exportXXXXXX";
+  std::string out = mkdtemp(outPath);
+  run(zip, out);
+  auto schema = read(out + "/store/ZMESSAGE/schema");
+  auto text = read(out + "/store/ZMESSAGE/1.col");
+  auto ids = read(out + "/store/ZMESSAGE/0.col");
+
+  // The uncompressed size in the local header of the database must only
+  // be trusted up to a limit and must match the data
+  std::string name = "data/store.wiredatabase";
+  auto header = std::search(zip.begin(), zip.end(), name.begin(), name.end()) -
+                30;
+  auto withSize = [&](uint32_t size) {
+    auto patched = zip;
+    memcpy(patched.data() + (header - zip.begin()) + 22, &size, sizeof(size));
+    try {
+      run(patched, out + "/size");
+    } catch (ExportException &) {
+      return true;
+    }
+    return false;
+  };
+  if (!withSize(0xFFFFFFF0) || !withSize(4096)) {
+    remove_dir(out);
+    return false;
+  }
+
+  // A database named "..." must not be exported outside of the output
+  for (auto it = zip.begin();
+       (it = std::search(it, zip.end(), name.begin(), name.end())) !=
+       zip.end();) {
+    it = std::copy_n("data/ab/...wiredatabase", name.size(), it);
+  }
+  run(zip, out + "/sub");
+  struct stat st;
+  bool escaped = stat((out + "/ZMESSAGE").c_str(), &st) == 0;
+  remove_dir(out);
+  if (escaped) {
+    return false;
+  }
+
+  const char expectedText[] = "\x02\0\0\0\x01"
+                              "\0\0\0\0\0\0\0\0\x02\0\0\0\0\0\0\0"
+                              "\x02\0\0\0\0\0\0\0"
+                              "hi";
+  const char expectedIds[] = "\x02\0\0\0\x03"
+                             "\x01\0\0\0\0\0\0\0\x02\0\0\0\0\0\0\0";
+  return schema == "Z_PK int64\nZTEXT binary\nZTIMESTAMP double\n" &&
+         text == std::string(expectedText, sizeof(expectedText) - 1) &&
+         ids == std::string(expectedIds, sizeof(expectedIds) - 1);
+}
+#endif
+
+#ifdef HAVE_WORKER
+bool test_isolated() {
+  auto encrypted = base64_decode(msg);
+
+  char inpPath[] = "/tmp/wire-decrypt-inXXXXXX";
+  char truncPath[] = "/tmp/wire-decrypt-truncXXXXXX";
+  close(mkstemp(inpPath));
+  close(mkstemp(truncPath));
+  ofstream(inpPath).write(encrypted.data(), encrypted.size());
+  // Header and crypto parameters only, the chunk is missing
+  ofstream(truncPath).write(encrypted.data(), 79);
+
+  auto outp = ostringstream();
+  StreamSink sink(outp);
+  auto good = decrypt_isolated(inpPath, sink, Password{"1235678", ""});
+  // Failing workers must not take down the supervisor
+  auto bad = decrypt_isolated(inpPath, sink, Password{"wrong", ""});
+  auto missing =
+      decrypt_isolated("/nonexistent/backup", sink, Password{"1235678", ""});
+  auto truncated = decrypt_isolated(truncPath, sink, Password{"1235678", ""});
+  // The key derivation alone takes longer than this
+  auto slow = decrypt_isolated(inpPath, sink, Password{"1235678", ""},
+                               std::chrono::milliseconds(1));
+  unlink(inpPath);
+  unlink(truncPath);
+  return good.success && good.size == 9 && outp.str() == "123456789" &&
+         !bad.success && !bad.error.empty() && !missing.success &&
+         !missing.error.empty() && !truncated.success &&
+         !truncated.error.empty() && !slow.success &&
+         slow.error == "Worker timed out";
+}
+#endif
+
 /// Do some little tests for decrypting-routine
 void test() {
   if (test_header()) {
@@ -98,9 +362,48 @@ void test() {
   } else {
     cout << "Incorrect header parsing" << endl;
   }
+  if (test_header_serialize()) {
+    cout << "Header serialization correct " << endl;
+  } else {
+    cout << "Incorrect header serialization" << endl;
+  }
   if (test_msg()) {
     cout << "MSG correct " << endl;
   } else {
     cout << "MSG incorrect" << endl;
   }
+  if (test_msg_file()) {
+    cout << "MSG file correct " << endl;
+  } else {
+    cout << "MSG file incorrect" << endl;
+  }
+  if (test_msg_sinks()) {
+    cout << "MSG sinks correct " << endl;
+  } else {
+    cout << "MSG sinks incorrect" << endl;
+  }
+  if (test_rekey()) {
+    cout << "Rekey correct " << endl;
+  } else {
+    cout << "Rekey incorrect" << endl;
+  }
+  if (test_zip_diff()) {
+    cout << "Zip diff correct " << endl;
+  } else {
+    cout << "Zip diff incorrect" << endl;
+  }
+#ifdef HAVE_EXPORT
+  if (test_export()) {
+    cout << "Export correct " << endl;
+  } else {
+    cout << "Export incorrect" << endl;
+  }
+#endif
+#ifdef HAVE_WORKER
+  if (test_isolated()) {
+    cout << "Isolated worker correct " << endl;
+  } else {
+    cout << "Isolated worker incorrect" << endl;
+  }
+#endif
 }
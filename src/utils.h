@@ -1,9 +1,12 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <cstdlib>
 #include <cstring>
 #include <memory>
+#include <stdexcept>
 #include <stdio.h>
+#include <string>
 #include <type_traits>
 #include <vector>
 
@@ -14,29 +17,159 @@
 #endif
 
 template <typename T> T swap_endian(T el) {
-  // TODO: I'm sure there are faster implementation, but this is just enough for
-  // now
-  auto res = new char[sizeof(T)];
+  T res;
   auto cur = reinterpret_cast<char *>(&el);
+  auto out = reinterpret_cast<char *>(&res);
   for (size_t i = 0; i < sizeof(T); i++) {
-    res[i] = cur[sizeof(T) - 1 - i];
+    out[i] = cur[sizeof(T) - 1 - i];
   }
-  return *reinterpret_cast<T *>(res);
+  return res;
 }
 
 using namespace std;
 
+/**
+ * ArrayView refers to a (sub-)range of an array of type T
+ * without owning it. The array has to outlive the view.
+ * It contains the same helper functions as DynamicArray
+ * to intepret its content.
+ */
+template <typename T> class ArrayView {
+public:
+  /**
+   * Initializes an empty ArrayView
+   */
+  ArrayView() : _data(nullptr), _size(0) {}
+
+  /**
+   * Refers to the given `array`
+   * @param array The array
+   * @param size The size of array
+   */
+  ArrayView(const T *array, unsigned int size) : _data(array), _size(size) {}
+
+  const T &operator[](int idx) const { return _data[idx]; }
+
+  /**
+   * Returns a const pointer to the array.
+   * @return A const pointer to the array
+   */
+  const T *ptr_const() const { return _data; }
+
+  /**
+   * Interprets the array of type T as an array of the signed variant of T.
+   * @return A const pointer to the array of the signed type
+   */
+  const typename std::make_signed<T>::type *ptr_signed_const() const {
+    return reinterpret_cast<const typename std::make_signed<T>::type *>(
+        _data);
+  }
+
+  /**
+   * Interprets the array of type T as an array of the unsigned variant of T.
+   * @return A const pointer to the array of the unsigned type
+   */
+  const typename std::make_unsigned<T>::type *ptr_unsigned_const() const {
+    return reinterpret_cast<const typename std::make_unsigned<T>::type *>(
+        _data);
+  }
+
+  int size() const { return _size; }
+
+  bool is_empty() const { return _size == 0; }
+
+  /**
+   * Returns a view of a subset of this array. Nothing is copied.
+   * @param beg The start of the subset (beginning at 0)
+   * @param end The end of the subset (exclusive)
+   * @return A new ArrayView which refers to the subset
+   */
+  ArrayView<T> sub(unsigned int beg, unsigned int end) const {
+    if (beg > end || end > _size) {
+      throw std::invalid_argument("Invalid values for beg or end");
+    }
+    return ArrayView<T>(_data + beg, end - beg);
+  }
+
+  /**
+   * Interprets the content as a string and returns it
+   * @return The content as string
+   */
+  string as_str() const {
+    return string(reinterpret_cast<const char *>(_data), _size * sizeof(T));
+  }
+
+  /**
+   * Interpret the content of this array as a value
+   * of type N, which was saved in little endian format.
+   */
+  template <typename N> N as_type_le() const {
+#ifndef IS_BIG_ENDIAN
+    return as_type_native<N>();
+#else
+    return swap_endian(as_type_native<N>());
+#endif
+  }
+
+  /**
+   * Interpret the content of this array as a value
+   * of type N, which was saved in the local format of this cpu.
+   */
+  template <typename N> N as_type_native() const {
+    if (_size * sizeof(T) != sizeof(N)) {
+      throw std::invalid_argument("cannot cast, size of array is invalid ");
+    }
+    N res;
+    memcpy(&res, _data, sizeof(N));
+    return res;
+  }
+
+  /**
+   * Interpret the content of this array as a value
+   * of type N, which was saved in big endian format.
+   */
+  template <typename N> N as_type_be() const {
+#ifdef IS_BIG_ENDIAN
+    return as_type_native<N>();
+#else
+    return swap_endian(as_type_native<N>());
+#endif
+  }
+
+  bool operator==(const ArrayView<T> &other) const {
+    // memcmp compares whole vector registers at once
+    return other._size == _size &&
+           (_size == 0 || memcmp(_data, other._data, _size * sizeof(T)) == 0);
+  }
+  bool operator!=(const ArrayView<T> &other) const {
+    return !operator==(other);
+  }
+
+private:
+  const T *_data;
+  unsigned int _size;
+};
+
 /**
  * DynamicArray capsules an array of type T.
  * Additionaly it contains some helper function
  * to intepret its content.
+ * Small arrays (like salts, hashes and keys) are stored inline,
+ * only bigger ones are allocated on the heap.
  */
 template <typename T> class DynamicArray {
+  static_assert(std::is_trivially_copyable<T>::value,
+                "DynamicArray copies its content bytewise");
+
 public:
+  /// Number of elements which are stored without heap allocation
+  static const unsigned int INLINE_SIZE =
+      sizeof(T) >= 64 ? 1 : 64 / sizeof(T);
+
   /**
    * Initializes an empty DynamicArray
    */
-  DynamicArray() : _size(0), _data(nullptr) {}
+  DynamicArray() : _size(0), _data(_inline) {}
 
   /**
    * Initializes an array of the given `size` and sets
@@ -44,26 +177,32 @@ public:
    * @param size the size of this array
    */
   DynamicArray(unsigned int size) : _size(size) {
-    _data = std::unique_ptr<T[]>(new T[size]);
-    memset(_data.get(), 0, size);
+    allocate(size);
+    memset(_data, 0, size * sizeof(T));
   }
 
   /**
    * Takes ownership of the given `array`
-   * @param array The array
+   * @param array The array, allocated with new[]
    * @param size The size of array
    */
-  DynamicArray(T *array, unsigned int size) : _size(size) {
-    _data = std::unique_ptr<T[]>(array);
+  DynamicArray(T *array, unsigned int size) : _size(size), _data(array) {}
+
+  /**
+   * Copy the content of `view` to initialize this array
+   * @param view The view to the content
+   */
+  explicit DynamicArray(const ArrayView<T> &view) : _size(view.size()) {
+    allocate(_size);
+    copy_from(view.ptr_const());
   }
 
   /**
    * Move the array from `other` to initialize this DynamicArray
    * @param other The other DynamicArray, which content should be moved.
    */
-  DynamicArray(DynamicArray<T> &&other) : _size(other._size) {
-    _data = std::move(other._data);
-    other._size = 0;
+  DynamicArray(DynamicArray<T> &&other) : _size(0), _data(_inline) {
+    take(std::move(other));
   }
 
   /**
@@ -71,9 +210,8 @@ public:
    * @param other The other DynamicArray, which content should be copied.
    */
   DynamicArray(const DynamicArray<T> &other) : _size(other._size) {
-    char *tmp = (char *)malloc(other.size() * sizeof(T));
-    memcpy(tmp, other.ptr_const(), _size);
-    _data = std::unique_ptr<T[]>(tmp);
+    allocate(_size);
+    copy_from(other._data);
   }
 
   /**
@@ -81,49 +219,69 @@ public:
    * @param other The vector with the content
    */
   DynamicArray(const vector<T> &other) : _size(other.size()) {
-    auto tmp = new T[_size];
-    std::copy(other.begin(), other.end(), tmp);
-    _data = std::unique_ptr<T[]>(tmp);
+    allocate(_size);
+    copy_from(other.data());
   }
 
+  ~DynamicArray() { reset(); }
+
   /**
    * Moves the array from `other` to this
    * @param other Another DynamicArray which content should be moved
    * @return a reference to this DynamicArray
    */
   DynamicArray<T> &operator=(DynamicArray<T> &&other) {
-    _data = std::move(other._data);
-    _size = other._size;
-    other._size = 0;
+    if (this != &other) {
+      reset();
+      take(std::move(other));
+    }
+    return *this;
+  }
+
+  /**
+   * Copies the array from `other` to this
+   * @param other Another DynamicArray which content should be copied
+   * @return a reference to this DynamicArray
+   */
+  DynamicArray<T> &operator=(const DynamicArray<T> &other) {
+    if (this != &other) {
+      *this = DynamicArray<T>(other);
+    }
     return *this;
   }
 
-  T &operator[](int idx) { return *(_data.get() + idx); }
+  T &operator[](int idx) { return _data[idx]; }
 
-  const T &operator[](int idx) const { return *(_data.get() + idx); }
+  const T &operator[](int idx) const { return _data[idx]; }
 
   /**
    * Returns the raw array. The content will be moved, so that
    * this DynamicArray-Object is not usable anymore after this
-   * operation.
+   * operation. The array has to be freed with delete[].
    * @return  The raw array.
    */
   T *release() {
+    T *res = _data;
+    if (is_inline()) {
+      res = new T[_size];
+      copy_to(res);
+    }
+    _data = _inline;
     _size = 0;
-    return _data.release();
+    return res;
   }
 
   /**
    * Returns a pointer to the array. DynamicArray retains the array.
    * @return A pointer to the array
    */
-  T *ptr() { return _data.get(); }
+  T *ptr() { return _data; }
 
   /**
    * Returns a const pointer to the array. DynamicArray retains the array.
    * @return A const pointer to the array
    */
-  const T *ptr_const() const { return _data.get(); }
+  const T *ptr_const() const { return _data; }
 
   /**
    * Interprets the array of type T as an array of the signed variant of T.
@@ -174,10 +332,7 @@ public:
    * @return A new DynamicArray of the signed type
    */
   DynamicArray<typename std::make_signed<T>::type> to_signed() {
-    auto size = _size;
-    auto data =
-        reinterpret_cast<typename std::make_signed<T>::type *>(release());
-    return DynamicArray<typename std::make_signed<T>::typ>(data, size);
+    return convert<typename std::make_signed<T>::type>();
   }
 
   /**
@@ -189,10 +344,23 @@ public:
    * @return A new DynamicArray of the signed type
    */
   DynamicArray<typename std::make_unsigned<T>::type> to_unsigned() {
-    auto size = _size;
-    auto data =
-        reinterpret_cast<typename std::make_unsigned<T>::type *>(release());
-    return DynamicArray<typename std::make_unsigned<T>::type>(data, size);
+    return convert<typename std::make_unsigned<T>::type>();
+  }
+
+  /**
+   * Returns a view of the whole array
+   */
+  ArrayView<T> view() const { return ArrayView<T>(_data, _size); }
+
+  /**
+   * Returns a view of a subset of this DynamicArray. Nothing is copied,
+   * so this DynamicArray has to outlive the view.
+   * @param beg The start of the subset (beginning at 0)
+   * @param end The end of the subset (exclusive)
+   * @return  A view which refers to the subset
+   */
+  ArrayView<T> sub(unsigned int beg, unsigned int end) const {
+    return view().sub(beg, end);
   }
 
   /**
@@ -202,32 +370,22 @@ public:
    * @param end The end of the subset (exclusive)
    * @return  A new DynamicArray which holds a subset
    */
-  DynamicArray<T> copy_sub(unsigned int beg, unsigned int end) {
-    if (beg < 0 || end > _size) {
-      throw std::invalid_argument("Invalid values for beg or end");
-    }
-    auto res = new T[end - beg];
-    memset(res, 0, end - beg);
-    std::copy(ptr() + beg, ptr() + end, res);
-    return DynamicArray<T>(res, end - beg);
+  DynamicArray<T> copy_sub(unsigned int beg, unsigned int end) const {
+    return DynamicArray<T>(sub(beg, end));
   }
 
   /**
    * Interprets the content as a string and returns it
    * @return The content as string
    */
-  string as_str() const { return string(ptr_const(), 0, _size); }
+  string as_str() const { return view().as_str(); }
 
   /**
    * Interpret the content of this array as a value
    * of type N, which was saved in little endian format.
    */
   template <typename N> N as_type_le() const {
-#ifndef IS_BIG_ENDIAN
-    return as_type_native<N>();
-#else
-    return swap_endian(as_type_native<N>());
-#endif
+    return view().template as_type_le<N>();
   }
 
   /**
@@ -235,10 +393,7 @@ public:
    * of type N, which was saved in the local format of this cpu.
    */
   template <typename N> N as_type_native() const {
-    if (_size != sizeof(N)) {
-      throw std::invalid_argument("cannot cast, size of array is invalid ");
-    }
-    return *reinterpret_cast<N *>(_data.get());
+    return view().template as_type_native<N>();
   }
 
   /**
@@ -246,34 +401,74 @@ public:
    * of type N, which was saved in big endian format.
    */
   template <typename N> N as_type_be() const {
-#ifdef IS_BIG_ENDIAN
-    return as_type_native<N>();
-#else
-    return swap_endian(as_type_native<N>());
-#endif
+    return view().template as_type_be<N>();
+  }
+
+  bool operator==(const DynamicArray<T> &other) const {
+    return view() == other.view();
   }
+  bool operator!=(const DynamicArray<T> &other) const {
+    return !operator==(other);
+  }
+
+  DynamicArray<T> clone() const { return DynamicArray<T>(*this); }
 
-  bool operator==(const DynamicArray<T> &other) {
-    // TODO: Faster implementation
-    if (other._size != _size)
-      return false;
-    for (unsigned int i = 0; i < _size; i++) {
-      if (_data[i] != other._data[i])
-        return false;
+private:
+  bool is_inline() const { return _data == _inline; }
+
+  void allocate(unsigned int size) {
+    _data = size <= INLINE_SIZE ? _inline : new T[size];
+  }
+
+  void reset() {
+    if (!is_inline()) {
+      delete[] _data;
+    }
+    _data = _inline;
+    _size = 0;
+  }
+
+  void copy_from(const T *data) {
+    if (_size > 0) {
+      memcpy(_data, data, _size * sizeof(T));
     }
-    return true;
   }
-  bool operator!=(const DynamicArray<T> &other) { return !operator==(other); }
 
-  DynamicArray<T> clone() const {
-    auto res = new T[_size];
-    std::copy(_data.get(), _data.get() + _size, res);
-    return DynamicArray<T>(res, _size);
+  void copy_to(T *data) const {
+    if (_size > 0) {
+      memcpy(data, _data, _size * sizeof(T));
+    }
+  }
+
+  /// Moves the content of `other` to this, which has to be empty
+  void take(DynamicArray<T> &&other) {
+    _size = other._size;
+    if (other.is_inline()) {
+      _data = _inline;
+      other.copy_to(_inline);
+    } else {
+      _data = other._data;
+    }
+    other._data = other._inline;
+    other._size = 0;
+  }
+
+  template <typename U> DynamicArray<U> convert() {
+    // Inline data always fits, but the compiler cannot know that
+    if (is_inline() && _size <= INLINE_SIZE) {
+      auto res =
+          DynamicArray<U>(ArrayView<U>(reinterpret_cast<U *>(_data), _size));
+      reset();
+      return res;
+    }
+    auto size = _size;
+    auto data = reinterpret_cast<U *>(release());
+    return DynamicArray<U>(data, size);
   }
 
-private:
   unsigned int _size;
-  unique_ptr<T[]> _data;
+  T *_data;
+  T _inline[INLINE_SIZE];
 };
 
 #endif // UTILS_H
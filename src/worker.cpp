@@ -0,0 +1,373 @@
+#include "worker.h"
+#include "fileio.h"
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstddef>
+#include <fcntl.h>
+#include <linux/audit.h>
+#include <linux/filter.h>
+#include <linux/futex.h>
+#include <linux/seccomp.h>
+#include <new>
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#if defined(__x86_64__)
+#define SECCOMP_ARCH AUDIT_ARCH_X86_64
+#elif defined(__aarch64__)
+#define SECCOMP_ARCH AUDIT_ARCH_AARCH64
+#endif
+
+#ifdef SECCOMP_RET_KILL_PROCESS
+#define SECCOMP_RET_DENY SECCOMP_RET_KILL_PROCESS
+#else
+#define SECCOMP_RET_DENY SECCOMP_RET_KILL
+#endif
+
+/// Offset of the first slot, the control block lives in the page before
+const size_t SLOTS_OFFSET = 4096;
+/// How long the supervisor sleeps before checking if the worker is alive
+const long WORKER_POLL_NS = 100 * 1000 * 1000;
+
+#define fail(descr)                                                            \
+  debug("%s: %s\n", descr, strerror(errno));                                   \
+  throw WorkerException(string(descr) + ": " + strerror(errno));
+
+enum RingState : uint32_t { Running, Done, Failed };
+
+/// Shared between worker and supervisor, at the start of the ring
+struct RingControl {
+  /// Number of chunks published by the worker
+  std::atomic<uint32_t> head;
+  /// Number of chunks the supervisor is done with
+  std::atomic<uint32_t> tail;
+  std::atomic<uint32_t> state;
+  uint32_t lengths[RING_SLOTS];
+  char error[256];
+};
+
+static_assert(sizeof(RingControl) <= SLOTS_OFFSET,
+              "Control block must fit in front of the slots");
+static_assert(sizeof(std::atomic<uint32_t>) == sizeof(uint32_t) &&
+                  std::atomic<uint32_t>::is_always_lock_free,
+              "Counters are used as futex words");
+
+static void futex_wait(std::atomic<uint32_t> &word, uint32_t expected,
+                       const timespec *timeout) {
+  // Not FUTEX_PRIVATE_FLAG, the word is shared between processes
+  syscall(SYS_futex, &word, FUTEX_WAIT, expected, timeout, nullptr, 0);
+}
+
+static void futex_wake(std::atomic<uint32_t> &word) {
+  syscall(SYS_futex, &word, FUTEX_WAKE, INT_MAX, nullptr, nullptr, 0);
+}
+
+/// Memory shared with the worker: control block and RING_SLOTS chunks
+class SharedRing {
+public:
+  SharedRing() : _size(SLOTS_OFFSET + RING_SLOTS * BUFFER_SIZE) {
+    int fd = memfd_create("wire-decrypt-ring", MFD_CLOEXEC);
+    if (fd < 0) {
+      fail("Cannot create shared memory");
+    }
+    if (ftruncate(fd, _size) != 0) {
+      close(fd);
+      fail("Cannot size shared memory");
+    }
+    _memory = static_cast<char *>(
+        mmap(nullptr, _size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+    // The mapping keeps the memory alive
+    close(fd);
+    if (_memory == MAP_FAILED) {
+      fail("Cannot map shared memory");
+    }
+    new (_memory) RingControl();
+  }
+  ~SharedRing() { munmap(_memory, _size); }
+  SharedRing(const SharedRing &) = delete;
+  SharedRing &operator=(const SharedRing &) = delete;
+
+  RingControl &control() { return *reinterpret_cast<RingControl *>(_memory); }
+  char *slot(uint32_t idx) {
+    return _memory + SLOTS_OFFSET + (idx % RING_SLOTS) * BUFFER_SIZE;
+  }
+
+private:
+  size_t _size;
+  char *_memory;
+};
+
+/// Runs in the worker and publishes the decrypted chunks to the ring
+class RingSink : public ChunkSink {
+public:
+  RingSink(SharedRing &ring) : _ring(ring), _head(0) {}
+
+  char *buffer(size_t length) override {
+    if (length > BUFFER_SIZE)
+      return nullptr;
+    waitForSlot();
+    return _ring.slot(_head);
+  }
+
+  void consume(const char *data, size_t length) override {
+    auto &control = _ring.control();
+    auto slot = _ring.slot(_head);
+    // Only chunks which were not decrypted into the ring need a copy
+    if (data != slot) {
+      if (length > BUFFER_SIZE) {
+        throw WorkerException("Chunk too large for ring");
+      }
+      waitForSlot();
+      memcpy(slot, data, length);
+    }
+    control.lengths[_head % RING_SLOTS] = length;
+    control.head.store(++_head, std::memory_order_release);
+    futex_wake(control.head);
+  }
+
+  void finish() override {
+    auto &control = _ring.control();
+    control.state.store(Done, std::memory_order_release);
+    futex_wake(control.head);
+  }
+
+private:
+  void waitForSlot() {
+    auto &control = _ring.control();
+    while (true) {
+      auto tail = control.tail.load(std::memory_order_acquire);
+      if (_head - tail < RING_SLOTS)
+        return;
+      futex_wait(control.tail, tail, nullptr);
+    }
+  }
+
+  SharedRing &_ring;
+  uint32_t _head;
+};
+
+#define ALLOW(name)                                                            \
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_##name, 0, 1),                      \
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW)
+// Only the lower half of the (little endian) argument, fds are 32 bit
+#define ALLOW_FD(name, fd)                                                     \
+  BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, __NR_##name, 0, 4),                      \
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, args[0])),     \
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, fd, 0, 1),                           \
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_ALLOW),                            \
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_DENY)
+
+/// Closes every descriptor but stderr and `fd`, which is moved to 3
+static int close_other_fds(int fd) {
+  const int target = STDERR_FILENO + 1;
+  if (fd != target) {
+    if (dup2(fd, target) < 0) {
+      fail("Cannot move input");
+    }
+    close(fd);
+  }
+  close(STDIN_FILENO);
+  close(STDOUT_FILENO);
+#ifdef __NR_close_range
+  if (syscall(__NR_close_range, target + 1, ~0U, 0) == 0)
+    return target;
+#endif
+  for (long i = target + 1; i < sysconf(_SC_OPEN_MAX) && i < 65536; i++) {
+    close(i);
+  }
+  return target;
+}
+
+/// Only allows what decrypting from an open file into the ring needs
+static void restrict_syscalls() {
+#ifdef SECCOMP_ARCH
+  struct sock_filter filter[] = {
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, arch)),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, SECCOMP_ARCH, 1, 0),
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_DENY),
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, offsetof(seccomp_data, nr)),
+      ALLOW(read),
+#ifdef __SANITIZE_ADDRESS__
+      // AddressSanitizer checks if memory is readable through a pipe
+      ALLOW(write),
+#else
+      ALLOW_FD(write, STDERR_FILENO),
+#endif
+      ALLOW_FD(writev, STDERR_FILENO),
+      ALLOW(lseek),
+      ALLOW(fadvise64),
+      ALLOW(close),
+      ALLOW(fstat),
+#ifdef __NR_newfstatat
+      ALLOW(newfstatat),
+#endif
+#ifdef __NR_brk
+      ALLOW(brk),
+#endif
+      ALLOW(mmap),
+      ALLOW(munmap),
+      ALLOW(mremap),
+      ALLOW(mprotect),
+      ALLOW(madvise),
+      ALLOW(futex),
+      ALLOW(getrandom),
+      ALLOW(clock_gettime),
+      ALLOW(rt_sigprocmask),
+      ALLOW(rt_sigreturn),
+      ALLOW(exit),
+      ALLOW(exit_group),
+#ifdef __SANITIZE_ADDRESS__
+      // Used by AddressSanitizer to probe memory and on exit
+      ALLOW(pipe2),
+      ALLOW(sigaltstack),
+#endif
+      BPF_STMT(BPF_RET | BPF_K, SECCOMP_RET_DENY),
+  };
+  struct sock_fprog program = {
+      static_cast<unsigned short>(sizeof(filter) / sizeof(filter[0])),
+      filter};
+  if (prctl(PR_SET_NO_NEW_PRIVS, 1, 0, 0, 0) != 0 ||
+      prctl(PR_SET_SECCOMP, SECCOMP_MODE_FILTER, &program) != 0) {
+    fail("Cannot install seccomp filter");
+  }
+#else
+  debug("No seccomp filter for this architecture, worker is unrestricted\n");
+#endif
+}
+
+/// Body of the worker process, never returns
+[[noreturn]] static void run_worker(SharedRing &ring, pid_t supervisor,
+                                    const std::string &inputPath,
+                                    const Password &password) {
+  auto &control = ring.control();
+  try {
+    // Do not outlive the supervisor, it would never drain the ring
+    prctl(PR_SET_PDEATHSIG, SIGKILL);
+    if (getppid() != supervisor)
+      _exit(1);
+
+    int fd = open(inputPath.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      fail("Cannot open input");
+    }
+    // Nothing inherited from the supervisor (e.g. its output files) must
+    // be reachable, only the input and stderr stay open
+    fd = close_other_fds(fd);
+    restrict_syscalls();
+
+    UncachedInputBuf inbuf(fd);
+    std::istream input(&inbuf);
+    RingSink sink(ring);
+    decrypt(input, sink, password);
+    _exit(0);
+  } catch (std::exception &e) {
+    strncpy(control.error, e.what(), sizeof(control.error) - 1);
+  } catch (...) {
+    strncpy(control.error, "Unknown error", sizeof(control.error) - 1);
+  }
+  control.state.store(Failed, std::memory_order_release);
+  futex_wake(control.head);
+  _exit(1);
+}
+
+static int wait_for(pid_t pid, int options) {
+  int status = 0;
+  pid_t res;
+  do {
+    res = waitpid(pid, &status, options);
+  } while (res < 0 && errno == EINTR);
+  if (res < 0) {
+    fail("Cannot wait for worker");
+  }
+  return res == 0 ? -1 : status;
+}
+
+JobResult decrypt_isolated(const std::string &inputPath, ChunkSink &output,
+                           Password password,
+                           std::chrono::milliseconds timeout) {
+  SharedRing ring;
+  auto &control = ring.control();
+
+  auto supervisor = getpid();
+  auto pid = fork();
+  if (pid < 0) {
+    fail("Cannot start worker");
+  }
+  if (pid == 0) {
+    run_worker(ring, supervisor, inputPath, password);
+  }
+
+  JobResult result;
+  uint32_t tail = 0;
+  int status = -1;
+  try {
+    const timespec poll = {0, WORKER_POLL_NS};
+    auto progress = std::chrono::steady_clock::now();
+    while (true) {
+      auto head = control.head.load(std::memory_order_acquire);
+      if (head != tail) {
+        auto length = control.lengths[tail % RING_SLOTS];
+        if (length > BUFFER_SIZE) {
+          result.error = "Invalid chunk from worker";
+          break;
+        }
+        output.consume(ring.slot(tail), length);
+        result.size += length;
+        control.tail.store(++tail, std::memory_order_release);
+        futex_wake(control.tail);
+        progress = std::chrono::steady_clock::now();
+        continue;
+      }
+      // The worker publishes all chunks before changing the state
+      if (control.state.load(std::memory_order_acquire) != Running) {
+        if (control.head.load(std::memory_order_acquire) == tail)
+          break;
+        continue;
+      }
+      if (status != -1)
+        break;
+      if (std::chrono::steady_clock::now() - progress > timeout) {
+        result.error = "Worker timed out";
+        break;
+      }
+      status = wait_for(pid, WNOHANG);
+      if (status == -1) {
+        futex_wait(control.head, head, &poll);
+      }
+    }
+  } catch (...) {
+    kill(pid, SIGKILL);
+    if (status == -1)
+      wait_for(pid, 0);
+    throw;
+  }
+  if (!result.error.empty()) {
+    kill(pid, SIGKILL);
+  }
+  if (status == -1) {
+    status = wait_for(pid, 0);
+  }
+  if (!result.error.empty())
+    return result;
+
+  if (control.state.load() == Failed) {
+    control.error[sizeof(control.error) - 1] = 0;
+    result.error = control.error;
+  } else if (WIFSIGNALED(status)) {
+    result.error = string("Worker killed by signal ") +
+                   std::to_string(WTERMSIG(status)) + " (" +
+                   strsignal(WTERMSIG(status)) + ")";
+  } else if (control.state.load() != Done || !WIFEXITED(status) ||
+             WEXITSTATUS(status) != 0) {
+    result.error = "Worker stopped unexpectedly";
+  } else {
+    output.finish();
+    result.success = true;
+  }
+  return result;
+}
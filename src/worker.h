@@ -0,0 +1,65 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include "crypto.h"
+#include <chrono>
+#include <exception>
+#include <string>
+
+/// Number of chunks the ring between worker and supervisor holds
+const unsigned int RING_SLOTS = 4;
+/// How long a worker may run without handing over a chunk by default
+const std::chrono::milliseconds JOB_TIMEOUT = std::chrono::seconds(60);
+
+/**
+ * Outcome of a job run in a worker process
+ */
+struct JobResult {
+  bool success = false;
+  /// Number of decrypted bytes handed to the sink
+  uint64_t size = 0;
+  /// Why the job failed, empty on success
+  std::string error;
+};
+
+/**
+ * Decrypts the file at `inputPath` in a separate worker process and hands
+ * the decrypted chunks to `output`, which runs in the calling process.
+ *
+ * The worker opens the input, closes every other descriptor but stderr
+ * and then restricts itself with a seccomp filter to reading, writing to
+ * stderr, memory management and futexes. It decrypts straight into a
+ * ring of chunk sized slots in shared memory (a memfd mapped by both
+ * processes), so `output` receives the chunks without them being copied.
+ * Both sides signal each other with futexes on the ring counters.
+ *
+ * A worker which fails, crashes, violates the filter or stops making
+ * progress only fails its own job: the result tells why and
+ * `output.finish()` is not called then. Exceptions thrown by `output` are
+ * passed on after the worker was killed.
+ *
+ * The worker is forked, so it must not be called while other threads are
+ * running (the worker allocates after the fork), e.g. `output` must not be
+ * a `FanOutSink`. The worker also starts with a copy of the caller's
+ * memory, so secrets of other jobs should not be held while calling this.
+ * @param inputPath The path to the encrypted backup
+ * @param output The sink which receives the decrypted data
+ * @param password The password for decrypting
+ * @param timeout The worker is killed if it does not hand over a chunk
+ * for this long (including the key derivation before the first chunk)
+ * @return The outcome of the job
+ */
+JobResult decrypt_isolated(const std::string &inputPath, ChunkSink &output,
+                           Password password,
+                           std::chrono::milliseconds timeout = JOB_TIMEOUT);
+
+class WorkerException : public std::exception {
+private:
+  std::string _text;
+
+public:
+  inline WorkerException(std::string &&text) : _text(text) {}
+  inline virtual const char *what() const throw() { return _text.c_str(); }
+};
+
+#endif // WORKER_H
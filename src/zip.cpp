@@ -0,0 +1,227 @@
+#include "zip.h"
+
+const uint32_t LOCAL_HEADER_SIG = 0x04034b50;
+const uint32_t DESCRIPTOR_SIG = 0x08074b50;
+const uint32_t CENTRAL_HEADER_SIG = 0x02014b50;
+const uint32_t END_OF_CENTRAL_SIG = 0x06054b50;
+const uint32_t ZIP64_END_OF_CENTRAL_SIG = 0x06064b50;
+/// Size of the local file header without signature
+const size_t LOCAL_HEADER_SIZE = 26;
+/// Flag telling that crc and sizes follow the data
+const uint16_t FLAG_DESCRIPTOR = 0x08;
+const uint16_t ZIP64_EXTRA_ID = 0x0001;
+
+#define fail(descr)                                                            \
+  debug(descr);                                                                \
+  throw ZipException(descr);
+
+template <typename N> static N le(const char *data) {
+  return ArrayView<char>(data, sizeof(N)).as_type_le<N>();
+}
+
+ZipSink::ZipSink()
+    : _state(State::Signature), _flags(0), _nameLength(0), _extraLength(0),
+      _zip64(false), _remaining(0), _written(0) {}
+
+void ZipSink::consume(const char *data, size_t length) {
+  process(data, length);
+  // Bytes which were read ahead while searching a data descriptor
+  while (!_replay.empty()) {
+    auto replay = std::move(_replay);
+    _replay.clear();
+    process(replay.data(), replay.size());
+  }
+}
+
+bool ZipSink::need(const char *&data, size_t &length, size_t count) {
+  if (_pending.size() < count) {
+    auto len = std::min(count - _pending.size(), length);
+    _pending.insert(_pending.end(), data, data + len);
+    data += len;
+    length -= len;
+  }
+  return _pending.size() >= count;
+}
+
+void ZipSink::process(const char *data, size_t length) {
+  while (true) {
+    switch (_state) {
+    case State::Signature: {
+      if (!need(data, length, 4))
+        return;
+      auto sig = le<uint32_t>(_pending.data());
+      _pending.clear();
+      if (sig == LOCAL_HEADER_SIG) {
+        _state = State::LocalHeader;
+      } else if (sig == CENTRAL_HEADER_SIG || sig == END_OF_CENTRAL_SIG ||
+                 sig == ZIP64_END_OF_CENTRAL_SIG) {
+        // All members were seen, the central directory is not needed
+        _state = State::Done;
+      } else {
+        fail("Invalid signature in zip\n");
+      }
+      break;
+    }
+    case State::LocalHeader: {
+      if (!need(data, length, LOCAL_HEADER_SIZE))
+        return;
+      auto header = _pending.data();
+      _member = ZipMember();
+      _flags = le<uint16_t>(header + 2);
+      _member.method = le<uint16_t>(header + 4);
+      _member.crc = le<uint32_t>(header + 10);
+      _member.compressedSize = le<uint32_t>(header + 14);
+      _member.size = le<uint32_t>(header + 18);
+      _nameLength = le<uint16_t>(header + 22);
+      _extraLength = le<uint16_t>(header + 24);
+      _pending.clear();
+      _state = State::Names;
+      break;
+    }
+    case State::Names:
+      if (!need(data, length, _nameLength + _extraLength))
+        return;
+      parseNames();
+      _pending.clear();
+      startMember(_member, !(_flags & FLAG_DESCRIPTOR));
+      if ((_flags & FLAG_DESCRIPTOR) && _member.compressedSize == 0) {
+        _state = State::SearchDescriptor;
+      } else {
+        _remaining = _member.compressedSize;
+        _state = State::Data;
+      }
+      break;
+    case State::Data: {
+      if (_remaining == 0) {
+        if (_flags & FLAG_DESCRIPTOR) {
+          _state = State::Descriptor;
+        } else {
+          endMember();
+          _state = State::Signature;
+        }
+        break;
+      }
+      if (length == 0)
+        return;
+      auto len = static_cast<size_t>(std::min<uint64_t>(_remaining, length));
+      writeData(data, len);
+      data += len;
+      length -= len;
+      _remaining -= len;
+      break;
+    }
+    case State::SearchDescriptor:
+      if (length > 0)
+        searchDescriptor(data, length);
+      return;
+    case State::Descriptor: {
+      if (!need(data, length, 4))
+        return;
+      // The signature of the data descriptor is optional
+      size_t offset = le<uint32_t>(_pending.data()) == DESCRIPTOR_SIG ? 4 : 0;
+      if (!need(data, length, offset + (_zip64 ? 20 : 12)))
+        return;
+      parseDescriptor(_pending.data() + offset, _zip64);
+      _pending.clear();
+      endMember();
+      _state = State::Signature;
+      break;
+    }
+    case State::Done:
+      return;
+    }
+  }
+}
+
+void ZipSink::parseNames() {
+  _member.name = std::string(_pending.data(), _nameLength);
+  _zip64 = false;
+  // Look for the zip64 extra field, which holds the real sizes
+  size_t idx = _nameLength;
+  size_t end = _nameLength + _extraLength;
+  while (idx + 4 <= end) {
+    auto id = le<uint16_t>(_pending.data() + idx);
+    auto len = le<uint16_t>(_pending.data() + idx + 2);
+    idx += 4;
+    if (idx + len > end)
+      break;
+    if (id == ZIP64_EXTRA_ID) {
+      _zip64 = true;
+      size_t field = idx;
+      if (_member.size == 0xFFFFFFFF && field + 8 <= idx + len) {
+        _member.size = le<uint64_t>(_pending.data() + field);
+        field += 8;
+      }
+      if (_member.compressedSize == 0xFFFFFFFF && field + 8 <= idx + len) {
+        _member.compressedSize = le<uint64_t>(_pending.data() + field);
+      }
+    }
+    idx += len;
+  }
+}
+
+void ZipSink::parseDescriptor(const char *data, bool zip64) {
+  _member.crc = le<uint32_t>(data);
+  if (zip64) {
+    _member.compressedSize = le<uint64_t>(data + 4);
+    _member.size = le<uint64_t>(data + 12);
+  } else {
+    _member.compressedSize = le<uint32_t>(data + 4);
+    _member.size = le<uint32_t>(data + 8);
+  }
+}
+
+void ZipSink::searchDescriptor(const char *data, size_t length) {
+  // The size of the data is unknown, so we look for a descriptor
+  // whose compressed size matches the bytes seen so far
+  const size_t descriptorLength = _zip64 ? 24 : 16;
+  _window.insert(_window.end(), data, data + length);
+
+  size_t idx = 0;
+  while (idx + descriptorLength <= _window.size()) {
+    auto found = static_cast<const char *>(
+        memchr(_window.data() + idx, 'P', _window.size() - idx));
+    if (!found)
+      break;
+    idx = found - _window.data();
+    if (idx + descriptorLength > _window.size())
+      break;
+    uint64_t compressedSize =
+        _zip64 ? le<uint64_t>(found + 8) : le<uint32_t>(found + 8);
+    if (le<uint32_t>(found) == DESCRIPTOR_SIG &&
+        compressedSize == _written + idx) {
+      writeData(_window.data(), idx);
+      parseDescriptor(found + 4, _zip64);
+      _replay.assign(_window.begin() + idx + descriptorLength, _window.end());
+      _window.clear();
+      endMember();
+      _state = State::Signature;
+      return;
+    }
+    idx++;
+  }
+
+  // Keep what could be the start of the descriptor
+  if (_window.size() >= descriptorLength) {
+    auto len = _window.size() - descriptorLength + 1;
+    writeData(_window.data(), len);
+    _window.erase(_window.begin(), _window.begin() + len);
+  }
+}
+
+void ZipSink::writeData(const char *data, size_t length) {
+  memberData(data, length);
+  _written += length;
+}
+
+void ZipSink::endMember() {
+  _written = 0;
+  finishMember(_member);
+}
+
+void ZipSink::finish() {
+  if (_state != State::Done &&
+      !(_state == State::Signature && _pending.empty())) {
+    fail("Zip ended within a member\n");
+  }
+}
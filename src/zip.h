@@ -0,0 +1,89 @@
+#ifndef ZIP_H
+#define ZIP_H
+
+#include "sink.h"
+#include <exception>
+#include <string>
+#include <vector>
+
+/**
+ * Information about a member of a zip archive
+ */
+struct ZipMember {
+  uint32_t crc = 0;
+  uint64_t size = 0;
+  uint64_t compressedSize = 0;
+  uint16_t method = 0;
+  std::string name;
+};
+
+/**
+ * Sink which parses a zip archive while it is streamed.
+ * Only the local headers are read, so no seeking is needed.
+ * Subclasses receive each member with its (still compressed) data.
+ */
+class ZipSink : public ChunkSink {
+public:
+  ZipSink();
+  void consume(const char *data, size_t length) override;
+  void finish() override;
+
+protected:
+  /**
+   * Called when a new member starts
+   * @param member The values from the local header
+   * @param complete False if crc and sizes follow the data
+   * (data descriptor). They are known in `finishMember` then.
+   */
+  virtual void startMember(const ZipMember &member, bool complete) = 0;
+  /**
+   * Called with the data of the current member, as stored in the zip
+   */
+  virtual void memberData(const char *data, size_t length) = 0;
+  /**
+   * Called after all data of the current member was handed over
+   */
+  virtual void finishMember(const ZipMember &member) = 0;
+
+private:
+  enum class State {
+    Signature,
+    LocalHeader,
+    Names,
+    Data,
+    SearchDescriptor,
+    Descriptor,
+    Done
+  };
+
+  void process(const char *data, size_t length);
+  bool need(const char *&data, size_t &length, size_t count);
+  void parseNames();
+  void parseDescriptor(const char *data, bool zip64);
+  void searchDescriptor(const char *data, size_t length);
+  void writeData(const char *data, size_t length);
+  void endMember();
+
+  State _state;
+  std::vector<char> _pending;
+  std::vector<char> _window;
+  std::vector<char> _replay;
+  ZipMember _member;
+  uint16_t _flags;
+  uint16_t _nameLength;
+  uint16_t _extraLength;
+  bool _zip64;
+  uint64_t _remaining;
+  uint64_t _written;
+};
+
+class ZipException : public std::exception {
+private:
+  std::string _text;
+
+public:
+  inline ZipException(std::string &&text) : _text(text) {}
+  inline virtual const char *what() const throw() { return _text.c_str(); }
+};
+
+#endif // ZIP_H
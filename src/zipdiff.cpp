@@ -0,0 +1,128 @@
+#include "zipdiff.h"
+#include <cerrno>
+#include <cstdio>
+#include <sstream>
+#include <sys/stat.h>
+
+#define fail(descr)                                                            \
+  debug(descr);                                                                \
+  throw ZipException(descr);
+
+static void make_dir(const std::string &path) {
+  if (mkdir(path.c_str(), 0755) != 0 && errno != EEXIST) {
+    fail("Cannot create store directory\n");
+  }
+}
+
+/// Name of the object holding the data of `member`
+static std::string object_name(const ZipMember &member) {
+  char res[64];
+  snprintf(res, sizeof(res), "%08x-%llu-%llu-%u", member.crc,
+           static_cast<unsigned long long>(member.size),
+           static_cast<unsigned long long>(member.compressedSize),
+           member.method);
+  return res;
+}
+
+ZipDiffSink::ZipDiffSink(const std::string &storeDir)
+    : _storeDir(storeDir), _writing(false) {
+  make_dir(_storeDir);
+  make_dir(_storeDir + "/objects");
+  loadIndex();
+}
+
+void ZipDiffSink::startMember(const ZipMember &member, bool complete) {
+  _writing = false;
+  // Without descriptor we already know if the member is stored
+  if (complete && isStored(member)) {
+    return;
+  }
+  _object.open(_storeDir + "/objects/.partial",
+               std::ios::binary | std::ios::trunc);
+  if (!_object) {
+    fail("Cannot create object in store\n");
+  }
+  _writing = true;
+}
+
+void ZipDiffSink::memberData(const char *data, size_t length) {
+  if (_writing && !_object.write(data, length)) {
+    fail("Cannot write object to store\n");
+  }
+}
+
+void ZipDiffSink::finishMember(const ZipMember &member) {
+  if (_writing) {
+    _object.close();
+    if (!_object) {
+      fail("Cannot write object to store\n");
+    }
+    auto partial = _storeDir + "/objects/.partial";
+    if (isStored(member)) {
+      std::remove(partial.c_str());
+    } else if (std::rename(partial.c_str(),
+                           (_storeDir + "/objects/" + object_name(member))
+                               .c_str()) != 0) {
+      fail("Cannot move object in store\n");
+    }
+    _writing = false;
+  }
+
+  auto prev = _previous.find(member.name);
+  if (prev == _previous.end()) {
+    _stats.added++;
+  } else if (object_name(prev->second) == object_name(member)) {
+    _stats.unchanged++;
+  } else {
+    _stats.changed++;
+  }
+  _current[member.name] = member;
+}
+
+bool ZipDiffSink::isStored(const ZipMember &member) const {
+  struct stat st;
+  auto path = _storeDir + "/objects/" + object_name(member);
+  return stat(path.c_str(), &st) == 0;
+}
+
+void ZipDiffSink::finish() {
+  ZipSink::finish();
+  for (auto &el : _previous) {
+    if (_current.find(el.first) == _current.end()) {
+      _stats.removed++;
+    }
+  }
+  saveIndex();
+}
+
+void ZipDiffSink::loadIndex() {
+  std::ifstream index(_storeDir + "/index");
+  std::string line;
+  while (std::getline(index, line)) {
+    std::istringstream fields(line);
+    ZipMember member;
+    fields >> std::hex >> member.crc >> std::dec >> member.size >>
+        member.compressedSize >> member.method;
+    fields.get();
+    std::getline(fields, member.name);
+    if (fields) {
+      _previous[member.name] = member;
+    }
+  }
+}
+
+void ZipDiffSink::saveIndex() {
+  auto path = _storeDir + "/index";
+  auto tmp = path + ".tmp";
+  std::ofstream index(tmp, std::ios::trunc);
+  for (auto &el : _current) {
+    auto &member = el.second;
+    index << std::hex << member.crc << std::dec << " " << member.size << " "
+          << member.compressedSize << " " << member.method << " "
+          << member.name << "\n";
+  }
+  index.close();
+  if (!index || std::rename(tmp.c_str(), path.c_str()) != 0) {
+    fail("Cannot write index of store\n");
+  }
+}
@@ -0,0 +1,65 @@
+#ifndef ZIPDIFF_H
+#define ZIPDIFF_H
+
+#include "zip.h"
+#include <fstream>
+#include <map>
+#include <string>
+
+/**
+ * Counts of the members, compared to the previous run
+ */
+struct ZipDiffStats {
+  unsigned int added = 0;
+  unsigned int changed = 0;
+  unsigned int unchanged = 0;
+  unsigned int removed = 0;
+};
+
+/**
+ * Sink which parses the decrypted zip while it is streamed and only stores
+ * members which are new or changed since the previous run.
+ *
+ * The store directory contains
+ *  - `objects/`: one file per distinct member content, holding the member
+ *    data as found in the zip (compressed with the given method)
+ *  - `index`: one line per member of the latest backup, referring to its
+ *    object. Unchanged members simply refer to the already stored object.
+ *
+ * Members are compared by CRC32 and sizes from the zip headers. If a
+ * member uses a data descriptor, those values are only known after its
+ * data, so it is written to a temporary file and dropped if unchanged.
+ */
+class ZipDiffSink : public ZipSink {
+public:
+  /**
+   * @param storeDir The directory holding the index and the objects.
+   * It is created if it does not exist yet.
+   */
+  ZipDiffSink(const std::string &storeDir);
+  void finish() override;
+
+  /**
+   * The result of the comparison. Only valid after `finish()`.
+   */
+  const ZipDiffStats &stats() const { return _stats; }
+
+protected:
+  void startMember(const ZipMember &member, bool complete) override;
+  void memberData(const char *data, size_t length) override;
+  void finishMember(const ZipMember &member) override;
+
+private:
+  bool isStored(const ZipMember &member) const;
+  void loadIndex();
+  void saveIndex();
+
+  std::string _storeDir;
+  std::map<std::string, ZipMember> _previous;
+  std::map<std::string, ZipMember> _current;
+  ZipDiffStats _stats;
+  bool _writing;
+  std::ofstream _object;
+};
+
+#endif // ZIPDIFF_H